@@ -0,0 +1,133 @@
+#!/usr/bin/env python3
+"""Generate a synthetic vendor-HAL-like corpus for benchmarking the plugin.
+
+The corpus mimics what the plugin meets in real SDKs:
+  * a device header with thousands of ((TYPE *) BASE) peripheral macros
+  * HAL modules whose APIs return status enums, directly or through locals
+  * function bodies with many loops
+  * deep include chains, every source pulling in most of the headers
+"""
+
+import argparse
+import os
+
+
+def write(path, lines):
+    with open(path, 'w') as f:
+        f.write('\n'.join(lines) + '\n')
+
+
+def gen_device(out, num_periphs):
+    lines = ['#pragma once', '#include <stdint.h>', '']
+    lines += ['typedef struct {',
+              '  volatile uint32_t CR;',
+              '  volatile uint32_t SR;',
+              '  volatile uint32_t DR;',
+              '} PERIPH_TypeDef;', '']
+    for i in range(num_periphs):
+        base = 0x40000000 + i * 0x400
+        lines.append('#define PERIPH%d_BASE (0x%08XUL)' % (i, base))
+        lines.append('#define PERIPH%d ((PERIPH_TypeDef *) PERIPH%d_BASE)'
+                     % (i, i))
+    write(os.path.join(out, 'device.h'), lines)
+
+
+def gen_chain(out, depth):
+    # hal_conf.h -> chain_0.h -> ... -> chain_<depth-1>.h -> device.h
+    for d in range(depth):
+        inc = 'chain_%d.h' % (d + 1) if d + 1 < depth else 'device.h'
+        write(os.path.join(out, 'chain_%d.h' % d),
+              ['#pragma once', '#include "%s"' % inc,
+               '#define CHAIN_LEVEL_%d %d' % (d, d)])
+    write(os.path.join(out, 'hal_conf.h'),
+          ['#pragma once', '#include "%s"' % ('chain_0.h' if depth
+                                              else 'device.h')])
+
+
+def gen_module(out, mod, num_funcs, num_loops, num_periphs):
+    hdr = ['#pragma once', '#include "hal_conf.h"', '',
+           'typedef enum {',
+           '  MOD%d_OK = 0,' % mod,
+           '  MOD%d_ERROR,' % mod,
+           '  MOD%d_BUSY,' % mod,
+           '  MOD%d_TIMEOUT' % mod,
+           '} MOD%d_StatusTypeDef;' % mod, '']
+    src = ['#include "hal_mod%d.h"' % mod, '']
+    for f in range(num_funcs):
+        name = 'HAL_MOD%d_Func%d' % (mod, f)
+        periph = 'PERIPH%d' % ((mod * num_funcs + f) % num_periphs)
+        if f % 2 == 0:
+            # returns the enum directly, the fast path
+            hdr.append('MOD%d_StatusTypeDef %s(uint32_t n);' % (mod, name))
+            src.append('MOD%d_StatusTypeDef %s(uint32_t n) {' % (mod, name))
+            src.append('  MOD%d_StatusTypeDef ret = MOD%d_OK;' % (mod, mod))
+        else:
+            # returns the enum through a local of another type
+            hdr.append('int %s(uint32_t n);' % name)
+            src.append('int %s(uint32_t n) {' % name)
+            src.append('  int ret = MOD%d_OK;' % mod)
+        for l in range(num_loops):
+            kind = l % 3
+            if kind == 0:
+                src.append('  for (uint32_t i = 0; i < n; ++i) {')
+                src.append('    %s->DR = i;' % periph)
+                src.append('  }')
+            elif kind == 1:
+                src.append('  while (!(%s->SR & (1u << %d))) {' % (periph,
+                                                                 l % 32))
+                src.append('    if (--n == 0) { ret = MOD%d_TIMEOUT; break; }'
+                           % mod)
+                src.append('  }')
+            else:
+                src.append('  do {')
+                src.append('    %s->CR |= %du;' % (periph, l))
+                src.append('  } while (%s->SR & 1u);' % periph)
+        src.append('  if (%s->SR & 2u) {' % periph)
+        src.append('    ret = MOD%d_ERROR;' % mod)
+        src.append('  }')
+        src.append('  return ret;')
+        src.append('}')
+        src.append('')
+    write(os.path.join(out, 'hal_mod%d.h' % mod), hdr)
+    write(os.path.join(out, 'hal_mod%d.c' % mod), src)
+
+
+def gen_umbrella(out, num_modules):
+    write(os.path.join(out, 'hal.h'),
+          ['#pragma once'] +
+          ['#include "hal_mod%d.h"' % m for m in range(num_modules)])
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('out', help='directory to generate the corpus in')
+    parser.add_argument('--modules', type=int, default=32,
+                        help='number of HAL modules, one TU each')
+    parser.add_argument('--funcs', type=int, default=40,
+                        help='APIs per module')
+    parser.add_argument('--loops', type=int, default=6,
+                        help='loops per API')
+    parser.add_argument('--periphs', type=int, default=4000,
+                        help='peripheral macros in the device header')
+    parser.add_argument('--include-depth', type=int, default=16,
+                        help='length of the include chain above the device '
+                             'header')
+    args = parser.parse_args()
+
+    os.makedirs(args.out, exist_ok=True)
+    gen_device(args.out, args.periphs)
+    gen_chain(args.out, args.include_depth)
+    for m in range(args.modules):
+        gen_module(args.out, m, args.funcs, args.loops, args.periphs)
+    gen_umbrella(args.out, args.modules)
+    # every TU includes all modules, as HAL sources including the umbrella do
+    for m in range(args.modules):
+        path = os.path.join(args.out, 'hal_mod%d.c' % m)
+        with open(path) as f:
+            body = f.read()
+        with open(path, 'w') as f:
+            f.write('#include "hal.h"\n' + body)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,113 @@
+#!/usr/bin/env python3
+"""Fail if the plugin's compile-time or memory overhead exceeds a budget.
+
+Every source of the corpus is compiled with and without the plugin. The CPU
+time (user + sys) and peak RSS of each compiler process are taken from
+wait4(), the best of the repetitions is kept, and the overhead of the plugin
+is the relative increase summed over the corpus.
+"""
+
+import argparse
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+
+OUTPUTS = ['succ-ret', 'api', 'loops', 'periph-struct']
+
+
+def plugin_args(plugin, out_dir):
+    args = ['-Xclang', '-load', '-Xclang', plugin,
+            '-Xclang', '-add-plugin', '-Xclang', 'perry']
+    for name in OUTPUTS:
+        args += ['-Xclang', '-plugin-arg-perry',
+                 '-Xclang', '-out-file-' + name,
+                 '-Xclang', '-plugin-arg-perry',
+                 '-Xclang', os.path.join(out_dir, name + '.yaml')]
+    return args
+
+
+def measure(cmd):
+    """Return (cpu seconds, peak rss in KiB) of running cmd."""
+    proc = subprocess.Popen(cmd, stdout=subprocess.DEVNULL)
+    _, status, usage = os.wait4(proc.pid, 0)
+    # the child is reaped already, keep Popen from waiting for it again
+    proc.returncode = status
+    if not os.WIFEXITED(status) or os.WEXITSTATUS(status):
+        sys.exit('Failed to compile: ' + ' '.join(cmd))
+    return usage.ru_utime + usage.ru_stime, usage.ru_maxrss
+
+
+def best_of(repeat, cmd, before=None):
+    cpu = rss = None
+    for _ in range(repeat):
+        if before:
+            before()
+        c, r = measure(cmd)
+        cpu = c if cpu is None else min(cpu, c)
+        rss = r if rss is None else min(rss, r)
+    return cpu, rss
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('--clang', required=True, help='clang to compile with')
+    parser.add_argument('--plugin', required=True, help='the plugin library')
+    parser.add_argument('--corpus', required=True,
+                        help='directory with the sources to compile')
+    parser.add_argument('--check', choices=['time', 'rss'], action='append',
+                        required=True, help='what to check, can be repeated')
+    parser.add_argument('--time-budget', type=float, default=30,
+                        help='maximum CPU time overhead in percent')
+    parser.add_argument('--rss-budget', type=float, default=20,
+                        help='maximum peak RSS overhead in percent')
+    parser.add_argument('--repeat', type=int, default=3,
+                        help='repetitions of every compilation')
+    args = parser.parse_args()
+
+    sources = sorted(os.path.join(args.corpus, f)
+                     for f in os.listdir(args.corpus) if f.endswith('.c'))
+    if not sources:
+        sys.exit('No sources in ' + args.corpus)
+
+    out_dir = tempfile.mkdtemp(prefix='perry-gate-')
+
+    def reset():
+        # every compilation starts from empty outputs, like a clean build
+        for f in os.listdir(out_dir):
+            os.remove(os.path.join(out_dir, f))
+
+    base_cpu = base_rss = plugin_cpu = plugin_rss = 0
+    try:
+        for src in sources:
+            cmd = [args.clang, '-c', '-O0', '-I', args.corpus, src,
+                   '-o', os.devnull]
+            cpu, rss = best_of(args.repeat, cmd)
+            base_cpu += cpu
+            base_rss = max(base_rss, rss)
+            cpu, rss = best_of(args.repeat,
+                               cmd + plugin_args(args.plugin, out_dir), reset)
+            plugin_cpu += cpu
+            plugin_rss = max(plugin_rss, rss)
+    finally:
+        shutil.rmtree(out_dir, ignore_errors=True)
+
+    failed = False
+    if 'time' in args.check:
+        overhead = (plugin_cpu - base_cpu) / base_cpu * 100
+        print('CPU time: %.2f s without, %.2f s with the plugin, '
+              '%+.1f %% (budget %.1f %%)' %
+              (base_cpu, plugin_cpu, overhead, args.time_budget))
+        failed |= overhead > args.time_budget
+    if 'rss' in args.check:
+        overhead = (plugin_rss - base_rss) / base_rss * 100
+        print('Peak RSS: %d KiB without, %d KiB with the plugin, '
+              '%+.1f %% (budget %.1f %%)' %
+              (base_rss, plugin_rss, overhead, args.rss_budget))
+        failed |= overhead > args.rss_budget
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
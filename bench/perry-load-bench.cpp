@@ -0,0 +1,57 @@
+#include "PerryResults.h"
+
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <chrono>
+#include <functional>
+
+using namespace llvm;
+
+static cl::opt<std::string>
+SuccRetFile(cl::Positional, cl::Required, cl::desc("<succ-ret file>"));
+
+static cl::opt<std::string>
+ApiFile(cl::Positional, cl::Required, cl::desc("<api file>"));
+
+static cl::opt<std::string>
+LoopsFile(cl::Positional, cl::Required, cl::desc("<loops file>"));
+
+static cl::opt<std::string>
+StructNamesFile(cl::Positional, cl::Required,
+                cl::desc("<periph-struct file>"));
+
+static cl::opt<unsigned>
+Repeat("n", cl::init(3), cl::desc("Repetitions, the best one is reported"));
+
+static bool bench(const char *Name, const std::string &Path,
+                  std::function<bool(const std::string &, PerryResults &)>
+                    Loader) {
+  double Best = 0;
+  for (unsigned i = 0; i < Repeat; ++i) {
+    PerryResults R;
+    auto Start = std::chrono::steady_clock::now();
+    if (!Loader(Path, R)) {
+      return false;
+    }
+    double Ms = std::chrono::duration<double, std::milli>(
+      std::chrono::steady_clock::now() - Start).count();
+    if (!i || Ms < Best) {
+      Best = Ms;
+    }
+  }
+  outs() << format("  %-16s %10.2f ms\n", Name, Best);
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  cl::ParseCommandLineOptions(argc, argv, "Time loading Perry output files\n");
+  if (!bench("succ-ret", SuccRetFile, SuccRetCacheLoader) ||
+      !bench("api", ApiFile, ApiCacheLoader) ||
+      !bench("loops", LoopsFile, LoopCacheLoader) ||
+      !bench("periph-struct", StructNamesFile, StructCacheLoader)) {
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,160 @@
+#!/usr/bin/env python3
+"""Benchmark the plugin on a synthetic HAL corpus.
+
+Measures:
+  * the per-TU overhead of the plugin relative to plain clang
+  * how updating the shared output files scales with 1 to N concurrent
+    compiler processes
+  * how long loading the output files takes
+"""
+
+import argparse
+import concurrent.futures
+import json
+import os
+import shutil
+import subprocess
+import sys
+import time
+
+OUTPUTS = ['succ-ret', 'api', 'loops', 'periph-struct']
+
+
+def plugin_args(plugin, out_dir, extra=()):
+    args = ['-Xclang', '-load', '-Xclang', plugin,
+            '-Xclang', '-add-plugin', '-Xclang', 'perry']
+    for name in OUTPUTS:
+        args += ['-Xclang', '-plugin-arg-perry',
+                 '-Xclang', '-out-file-' + name,
+                 '-Xclang', '-plugin-arg-perry',
+                 '-Xclang', os.path.join(out_dir, name + '.yaml')]
+    for arg in extra:
+        args += ['-Xclang', '-plugin-arg-perry', '-Xclang', arg]
+    return args
+
+
+def compile_cmd(clang, corpus, src, extra=()):
+    return [clang, '-c', '-O0', '-I', corpus, src, '-o', os.devnull] + \
+        list(extra)
+
+
+def run_timed(cmd):
+    start = time.perf_counter()
+    subprocess.run(cmd, check=True, stdout=subprocess.DEVNULL)
+    return time.perf_counter() - start
+
+
+def reset_dir(path):
+    shutil.rmtree(path, ignore_errors=True)
+    os.makedirs(path)
+
+
+def bench_overhead(args, sources):
+    out_dir = os.path.join(args.work_dir, 'overhead')
+    base_total = plugin_total = 0.0
+    for src in sources:
+        # best of the repetitions filters out noise from the machine
+        base = min(run_timed(compile_cmd(args.clang, args.corpus, src))
+                   for _ in range(args.repeat))
+        with_plugin = []
+        for _ in range(args.repeat):
+            reset_dir(out_dir)
+            with_plugin.append(run_timed(compile_cmd(
+                args.clang, args.corpus, src,
+                plugin_args(args.plugin, out_dir))))
+        base_total += base
+        plugin_total += min(with_plugin)
+    n = len(sources)
+    print('Per-TU overhead (best of %d, %d TUs)' % (args.repeat, n))
+    print('  clang:          %8.1f ms' % (base_total / n * 1000))
+    print('  clang + plugin: %8.1f ms' % (plugin_total / n * 1000))
+    print('  overhead:       %8.1f %%' %
+          ((plugin_total - base_total) / base_total * 100))
+
+
+def percentile(values, p):
+    if not values:
+        return 0.0
+    values = sorted(values)
+    rank = max(1, -(-len(values) * p // 100))
+    return values[int(rank) - 1]
+
+
+def bench_scaling(args, sources):
+    print('Concurrent updates of the output files (%d TUs)' % len(sources))
+    print('  %5s %10s %10s %14s %14s' %
+          ('jobs', 'wall s', 'TUs/s', 'p50 wait ms', 'p99 wait ms'))
+    jobs = 1
+    out_dir = None
+    while True:
+        out_dir = os.path.join(args.work_dir, 'scaling-%d' % jobs)
+        reset_dir(out_dir)
+        stats = os.path.join(out_dir, 'stats.jsonl')
+        cmds = [compile_cmd(args.clang, args.corpus, src,
+                            plugin_args(args.plugin, out_dir,
+                                        ['-stats-file', stats]))
+                for src in sources]
+        start = time.perf_counter()
+        with concurrent.futures.ThreadPoolExecutor(jobs) as pool:
+            list(pool.map(lambda cmd: subprocess.run(
+                cmd, check=True, stdout=subprocess.DEVNULL), cmds))
+        wall = time.perf_counter() - start
+        waits = []
+        with open(stats) as f:
+            for line in f:
+                try:
+                    waits.append(json.loads(line)['lock_wait_ms'])
+                except (ValueError, KeyError):
+                    pass
+        print('  %5d %10.2f %10.1f %14.1f %14.1f' %
+              (jobs, wall, len(sources) / wall, percentile(waits, 50),
+               percentile(waits, 99)))
+        if jobs >= args.jobs:
+            break
+        jobs = min(jobs * 2, args.jobs)
+    return out_dir
+
+
+def bench_load(args, out_dir):
+    if not args.load_bench:
+        return
+    print('Loading the output files (best of %d)' % args.repeat)
+    cmd = [args.load_bench, '-n', str(args.repeat)]
+    cmd += [os.path.join(out_dir, name + '.yaml') for name in OUTPUTS]
+    subprocess.run(cmd, check=True)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('--clang', required=True, help='clang to compile with')
+    parser.add_argument('--plugin', required=True, help='the plugin library')
+    parser.add_argument('--load-bench', help='perry-load-bench executable')
+    parser.add_argument('--work-dir', required=True,
+                        help='directory for the corpus and the outputs')
+    parser.add_argument('--corpus',
+                        help='existing corpus, generated if not given')
+    parser.add_argument('--jobs', type=int, default=os.cpu_count(),
+                        help='maximum number of concurrent compilations')
+    parser.add_argument('--repeat', type=int, default=3,
+                        help='repetitions of every measurement')
+    parser.add_argument('--gen-args', default='',
+                        help='arguments passed on to gen-hal.py')
+    args = parser.parse_args()
+
+    if not args.corpus:
+        args.corpus = os.path.join(args.work_dir, 'corpus')
+        reset_dir(args.corpus)
+        gen = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                           'gen-hal.py')
+        subprocess.run([sys.executable, gen, args.corpus] +
+                       args.gen_args.split(), check=True)
+    sources = sorted(os.path.join(args.corpus, f)
+                     for f in os.listdir(args.corpus) if f.endswith('.c'))
+
+    bench_overhead(args, sources)
+    out_dir = bench_scaling(args, sources)
+    bench_load(args, out_dir)
+
+
+if __name__ == '__main__':
+    main()
@@ -11,6 +11,24 @@ std::string OutApiFile;
 std::string OutSuccRetFile;
 std::string OutLoopFile;
 std::string OutStructNameFile;
+std::string OutShardDir;
+std::string OutDatabaseFile;
+std::string OutJournalFile;
+std::string JournalCompactSize;
+std::string DaemonSocket;
+std::string LockWaitBudget;
+std::string StatsFile;
+std::string OutSharedTableFile;
+std::string IncrementalCacheDir;
+std::string HeaderCacheDir;
+bool ScopeSkipSystem = false;
+bool TimeSummary = false;
+bool AsyncFlush = false;
+bool Provenance = false;
+std::vector<std::string> ScopeAllow;
+std::vector<std::string> ScopeDeny;
+bool PeriphStructOnly = false;
+std::string plugin_name = "perry";
 std::vector<std::string> cc_params;
 
 struct FlagSet {
@@ -63,6 +81,12 @@ static void add_option(const std::string &opt) {
   cc_params.push_back(opt);
 }
 
+inline
+static void add_plugin_arg(const std::string &arg) {
+  add_option("-plugin-arg-" + plugin_name);
+  add_option(arg);
+}
+
 static void find_obj(const std::string &cmd) {
   SmallString<128> path_vec;
   std::error_code err_code = sys::fs::real_path(cmd, path_vec, true);
@@ -143,51 +167,230 @@ static void edit_params(const std::vector<std::string> &argv) {
       continue;
     }
 
-    tmp_params.push_back(*it);
-  }
+    if (arg.startswith("-out-shard-dir=")) {
+      OutShardDir = arg.substr(sizeof("-out-shard-dir=") - 1);
+      continue;
+    }
+
+    if (arg.startswith("-out-db-file=")) {
+      OutDatabaseFile = arg.substr(sizeof("-out-db-file=") - 1);
+      continue;
+    }
+
+    if (arg.startswith("-out-journal-file=")) {
+      OutJournalFile = arg.substr(sizeof("-out-journal-file=") - 1);
+      continue;
+    }
+
+    if (arg.startswith("-journal-compact-size=")) {
+      JournalCompactSize = arg.substr(sizeof("-journal-compact-size=") - 1);
+      continue;
+    }
+
+    if (arg.startswith("-daemon-socket=")) {
+      DaemonSocket = arg.substr(sizeof("-daemon-socket=") - 1);
+      continue;
+    }
+
+    if (arg.startswith("-out-shm-file=")) {
+      OutSharedTableFile = arg.substr(sizeof("-out-shm-file=") - 1);
+      continue;
+    }
+
+    if (arg.startswith("-lock-wait-budget=")) {
+      LockWaitBudget = arg.substr(sizeof("-lock-wait-budget=") - 1);
+      continue;
+    }
+
+    if (arg.startswith("-incremental-cache-dir=")) {
+      IncrementalCacheDir = arg.substr(sizeof("-incremental-cache-dir=") - 1);
+      continue;
+    }
+
+    if (arg.startswith("-header-cache-dir=")) {
+      HeaderCacheDir = arg.substr(sizeof("-header-cache-dir=") - 1);
+      continue;
+    }
+
+    if (arg.startswith("-stats-file=")) {
+      StatsFile = arg.substr(sizeof("-stats-file=") - 1);
+      continue;
+    }
+
+    if (arg.equals("-time-summary")) {
+      TimeSummary = true;
+      continue;
+    }
+
+    if (arg.equals("-async-flush")) {
+      AsyncFlush = true;
+      continue;
+    }
+
+    if (arg.equals("-provenance")) {
+      Provenance = true;
+      continue;
+    }
+
+    if (arg.equals("-scope-skip-system")) {
+      ScopeSkipSystem = true;
+      continue;
+    }
 
-  if (has_source) {
-    if (OutApiFile.empty()) {
-      outs() << "No path given for the output API file, "
-                "default to \'api.yaml\'\n";
-      OutApiFile = "api.yaml";
+    if (arg.startswith("-scope-allow=")) {
+      ScopeAllow.push_back(arg.substr(sizeof("-scope-allow=") - 1).str());
+      continue;
     }
-    if (OutSuccRetFile.empty()) {
-      outs() << "No path given for the output Success return file, "
-                "default to \'succ-ret.yaml\'\n";
-      OutSuccRetFile = "succ-ret.yaml";
+
+    if (arg.startswith("-scope-deny=")) {
+      ScopeDeny.push_back(arg.substr(sizeof("-scope-deny=") - 1).str());
+      continue;
     }
-    if (OutLoopFile.empty()) {
-      outs() << "No path given for the output loops file, "
-                "default to \'loops.yaml\'\n";
-      OutLoopFile = "loops.yaml";
+
+    if (arg.equals("-periph-struct-only")) {
+      PeriphStructOnly = true;
+      continue;
     }
+
+    tmp_params.push_back(*it);
+  }
+
+  if (has_source && PeriphStructOnly) {
+    // only run the preprocessor to collect peripheral structs, the action
+    // replaces the main one, which -add-plugin would leave in place
+    plugin_name = "perry-periph-struct";
+    add_option("-load");
+    add_option(plugin_path);
+    add_option("-plugin");
+    add_option(plugin_name);
+
     if (OutStructNameFile.empty()) {
       outs() << "No path given for the output periph struct name file, "
                 "default to \'periph-struct.yaml\'\n";
       OutStructNameFile = "periph-struct.yaml";
     }
+    add_plugin_arg("-out-file-periph-struct");
+    add_plugin_arg(OutStructNameFile);
+    if (!LockWaitBudget.empty()) {
+      add_plugin_arg("-lock-wait-budget");
+      add_plugin_arg(LockWaitBudget);
+    }
 
+    // nothing is compiled, so the driver must not expect an object file or
+    // run any job after this one. The cc1 action it implies is overridden by
+    // -plugin, which comes later
+    cc_params.push_back("-fsyntax-only");
+  } else if (has_source) {
     add_option("-load");
     add_option(plugin_path);
     add_option("-add-plugin");
-    add_option("perry");
-    add_option("-plugin-arg-perry");
-    add_option("-out-file-succ-ret");
-    add_option("-plugin-arg-perry");
-    add_option(OutSuccRetFile);
-    add_option("-plugin-arg-perry");
-    add_option("-out-file-api");
-    add_option("-plugin-arg-perry");
-    add_option(OutApiFile);
-    add_option("-plugin-arg-perry");
-    add_option("-out-file-loops");
-    add_option("-plugin-arg-perry");
-    add_option(OutLoopFile);
-    add_option("-plugin-arg-perry");
-    add_option("-out-file-periph-struct");
-    add_option("-plugin-arg-perry");
-    add_option(OutStructNameFile);
+    add_option(plugin_name);
+
+    if (!LockWaitBudget.empty()) {
+      add_plugin_arg("-lock-wait-budget");
+      add_plugin_arg(LockWaitBudget);
+    }
+
+    if (!IncrementalCacheDir.empty()) {
+      add_plugin_arg("-incremental-cache-dir");
+      add_plugin_arg(IncrementalCacheDir);
+    }
+
+    if (!HeaderCacheDir.empty()) {
+      add_plugin_arg("-header-cache-dir");
+      add_plugin_arg(HeaderCacheDir);
+    }
+
+    if (TimeSummary) {
+      add_plugin_arg("-time-summary");
+    }
+
+    if (AsyncFlush) {
+      add_plugin_arg("-async-flush");
+    }
+
+    if (Provenance) {
+      add_plugin_arg("-provenance");
+    }
+
+    if (!StatsFile.empty()) {
+      add_plugin_arg("-stats-file");
+      add_plugin_arg(StatsFile);
+    }
+
+    if (ScopeSkipSystem) {
+      add_plugin_arg("-scope-skip-system");
+    }
+    for (auto &Prefix : ScopeAllow) {
+      add_plugin_arg("-scope-allow");
+      add_plugin_arg(Prefix);
+    }
+    for (auto &Prefix : ScopeDeny) {
+      add_plugin_arg("-scope-deny");
+      add_plugin_arg(Prefix);
+    }
+
+    if (!OutShardDir.empty()) {
+      // output files are produced later by perry-merge
+      add_plugin_arg("-out-shard-dir");
+      add_plugin_arg(OutShardDir);
+    } else if (!OutDatabaseFile.empty()) {
+      // output files are exported from the database by perry-merge
+      add_plugin_arg("-out-file-db");
+      add_plugin_arg(OutDatabaseFile);
+    } else {
+      if (!DaemonSocket.empty()) {
+        // the output files are only written if the daemon cannot be reached
+        add_plugin_arg("-daemon-socket");
+        add_plugin_arg(DaemonSocket);
+      }
+
+      if (!OutSharedTableFile.empty()) {
+        // the output files are only written if the shared table is full
+        add_plugin_arg("-out-file-shm");
+        add_plugin_arg(OutSharedTableFile);
+      }
+
+      if (!OutJournalFile.empty()) {
+        // the output files are only written when the journal is compacted
+        add_plugin_arg("-out-file-journal");
+        add_plugin_arg(OutJournalFile);
+        if (!JournalCompactSize.empty()) {
+          add_plugin_arg("-journal-compact-size");
+          add_plugin_arg(JournalCompactSize);
+        }
+      }
+
+      if (OutApiFile.empty()) {
+        outs() << "No path given for the output API file, "
+                  "default to \'api.yaml\'\n";
+        OutApiFile = "api.yaml";
+      }
+      if (OutSuccRetFile.empty()) {
+        outs() << "No path given for the output Success return file, "
+                  "default to \'succ-ret.yaml\'\n";
+        OutSuccRetFile = "succ-ret.yaml";
+      }
+      if (OutLoopFile.empty()) {
+        outs() << "No path given for the output loops file, "
+                  "default to \'loops.yaml\'\n";
+        OutLoopFile = "loops.yaml";
+      }
+      if (OutStructNameFile.empty()) {
+        outs() << "No path given for the output periph struct name file, "
+                  "default to \'periph-struct.yaml\'\n";
+        OutStructNameFile = "periph-struct.yaml";
+      }
+
+      add_plugin_arg("-out-file-succ-ret");
+      add_plugin_arg(OutSuccRetFile);
+      add_plugin_arg("-out-file-api");
+      add_plugin_arg(OutApiFile);
+      add_plugin_arg("-out-file-loops");
+      add_plugin_arg(OutLoopFile);
+      add_plugin_arg("-out-file-periph-struct");
+      add_plugin_arg(OutStructNameFile);
+    }
 
     // UBSan
     cc_params.push_back("-fsanitize=bounds");
@@ -5,53 +5,32 @@
 #include "clang/AST/Stmt.h"
 #include "clang/AST/ASTConsumer.h"
 #include "clang/AST/RecursiveASTVisitor.h"
-#include "clang/ASTMatchers/ASTMatchFinder.h"
-#include "clang/ASTMatchers/ASTMatchers.h"
 #include "clang/Frontend/CompilerInstance.h"
+#include "clang/Lex/MacroInfo.h"
 #include "clang/Lex/PPCallbacks.h"
+#include "llvm/Support/Timer.h"
 
-using EnumMapTy 
-  = std::map<const clang::EnumConstantDecl*, const clang::EnumDecl*>;
+#include "PerryResults.h"
 
-using LoopRangeSet
-   = std::set<std::pair<clang::SourceLocation::UIntTy,
-                        clang::SourceLocation::UIntTy>>;
+#include <functional>
+#include <map>
+#include <set>
 
-// ASTMatcher callback when enum is matched
-class PerryEnumMatcher 
-  : public clang::ast_matchers::MatchFinder::MatchCallback {
-public:
-  explicit PerryEnumMatcher(EnumMapTy &);
-  void run(const clang::ast_matchers::MatchFinder::MatchResult &) override;
-
-private:
-  EnumMapTy &EnumValToDecl;
-};
+// loop ranges as begin and end offsets, grouped by the file they are in
+using LoopRangeMap
+   = llvm::DenseMap<clang::FileID,
+                    std::vector<std::pair<unsigned, unsigned>>>;
 
-// ASTMatcher callback when for loop is matched
-class PerryLoopMatcher 
-  : public clang::ast_matchers::MatchFinder::MatchCallback {
-public:
-  explicit PerryLoopMatcher(clang::SourceManager &, LoopRangeSet &);
-  void run(const clang::ast_matchers::MatchFinder::MatchResult &) override;
-private:
-  clang::SourceManager &SM;
-  LoopRangeSet &Loops;
-};
-
-// RecursiveASTVisitor
+// RecursiveASTVisitor, collects API declarations and definitions, success
+// returns and loops in a single traversal
 class PerryVisitor : public clang::RecursiveASTVisitor<PerryVisitor> {
 public:
   explicit PerryVisitor(clang::ASTContext *Context,
-                        std::map<std::string, uint64_t> &SuccRetValMap,
-                        const EnumMapTy &EnumValToDecl,
-                        std::set<std::string> &FuncDec,
-                        std::set<std::string> &FuncDef)
+                        PerryResults &Results,
+                        LoopRangeMap &Loops)
     : Context(Context),
-      SuccRetValMap(SuccRetValMap),
-      EnumValToDecl(EnumValToDecl),
-      FuncDec(FuncDec),
-      FuncDef(FuncDef) {}
+      Results(Results),
+      Loops(Loops) {}
   // traverse all function
   bool TraverseFunctionDecl(clang::FunctionDecl *FD);
   // traverse return statements
@@ -62,122 +41,254 @@ public:
   bool TraverseBinaryOperator(clang::BinaryOperator *BO);
   // visit return statements
   bool VisitDeclRefExpr(clang::DeclRefExpr *DRE);
+  // visit loops
+  bool VisitForStmt(clang::ForStmt *FS);
+  bool VisitWhileStmt(clang::WhileStmt *WS);
+  bool VisitDoStmt(clang::DoStmt *DS);
 private:
   clang::ASTContext *Context;
-  std::map<std::string, uint64_t> &SuccRetValMap;
-  const EnumMapTy &EnumValToDecl;
-  std::set<std::string> &FuncDec;
-  std::set<std::string> &FuncDef;
+  PerryResults &Results;
+  LoopRangeMap &Loops;
 
   clang::ValueDecl *refVal = nullptr;
   llvm::SmallSet<const clang::EnumDecl*, 2> retEnum;
   llvm::SmallSet<const clang::VarDecl*, 2> retVar;
   llvm::SmallMapVector<const clang::VarDecl*, const clang::EnumDecl*, 16> varDeclWithEnum;
   llvm::SmallMapVector<const clang::VarDecl*, const clang::EnumDecl*, 16> varStoredWithEnum;
+  // record the function, returns true if its body has to be analyzed for
+  // success returns
+  bool recordFunction(clang::FunctionDecl *FD, const std::string &FuncName);
+  void analyzeReturns(const std::string &FuncName);
+  void recordSuccRet(const std::string &FuncName, const clang::EnumDecl *ED);
   bool isGoodEnumName(const llvm::StringRef &);
+  void recordLoop(clang::SourceLocation Begin, clang::SourceLocation End);
 };
 
-struct PerryLoopItem {
-  std::string FilePath;
-  unsigned beginLine = 0;
-  unsigned beginColumn = 0;
-  unsigned endLine = 0;
-  unsigned endColumn = 0;
-
-  PerryLoopItem(const std::string &FilePath, unsigned beginLine,
-                unsigned beginColumn, unsigned endLine, unsigned endColumn)
-    : FilePath(FilePath), beginLine(beginLine), beginColumn(beginColumn),
-      endLine(endLine), endColumn(endColumn) {}
-  PerryLoopItem() = default;
-  PerryLoopItem(const PerryLoopItem &PI)
-    : FilePath(PI.FilePath),
-      beginLine(PI.beginLine), beginColumn(PI.beginColumn),
-      endLine(PI.endLine), endColumn(PI.endColumn) {}
-
-  int compare(const PerryLoopItem &PI) const {
-    int file_cmp = FilePath.compare(PI.FilePath);
-    if (!file_cmp) {
-      uint64_t begin = (((uint64_t)beginLine << 32) | beginColumn);
-      uint64_t begin_pi = (((uint64_t)PI.beginLine << 32) | PI.beginColumn);
-      if (begin == begin_pi) {
-        uint64_t end = (((uint64_t)endLine << 32) | endColumn);
-        uint64_t end_pi = (((uint64_t)PI.endLine << 32) | PI.endColumn);
-        if (end == end_pi) {
-          return 0;
-        } else if (end < end_pi) {
-          return -1;
-        } else {
-          return 1;
-        }
-      } else if (begin < begin_pi) {
-        return -1;
-      } else {
-        return 1;
-      }
-    } else {
-      return file_cmp;
-    }
-  }
-
-  bool operator==(const PerryLoopItem &PI) const {
-    return (this->compare(PI) == 0);
-  }
-
-  bool operator<(const PerryLoopItem &PI) const {
-    return (this->compare(PI) < 0);
-  }
+// Timers of the plugin phases, reported on stderr with -time-summary. The
+// phases also show up in -ftime-trace whether or not this is enabled.
+struct PerryTimers {
+  llvm::TimerGroup Group{"perry", "Perry plugin"};
+  llvm::Timer Traverse{"traverse", "AST traversal", Group};
+  llvm::Timer Loops{"loops", "Loop collection", Group};
+  llvm::Timer Macros{"macros", "Peripheral struct macro classification", Group};
+  llvm::Timer LockWait{"lock-wait", "Output lock wait", Group};
+  llvm::Timer Load{"load", "Output load", Group};
+  llvm::Timer Write{"write", "Output write", Group};
 };
 
-// ASTConsumer
-class PerryASTConsumer : public clang::ASTConsumer {
+// What updating one output file cost a TU, written with -stats-file
+struct PerryCacheStats {
+  std::string Cache;
+  double LockWaitMs = 0;
+  unsigned Retries = 0;
+  unsigned Timeouts = 0;
+  bool Spilled = false;
+  uint64_t BytesRead = 0;
+  uint64_t BytesWritten = 0;
+  uint64_t RecordsAdded = 0;
+  uint64_t RecordsRetracted = 0;
+};
+
+// Where and how the plugin writes its results
+struct PerryOutputOptions {
+  // the four YAML files consumed by Perry, updated under a lock per TU
+  PerryOutputFiles Files;
+  // if set, each TU writes its own shard here instead, see perry-merge
+  std::string ShardDir;
+  // if set, all records go to this single file instead, see perry-merge
+  std::string DatabaseFile;
+  // if set, each TU appends its records here instead, see perry-merge
+  std::string JournalFile;
+  // fold the journal into Files once it grows beyond this size, 0 to never
+  uint64_t JournalCompactSize = 0;
+  // if set, append a JSON line with lock and I/O statistics of every TU here,
+  // see perry-stats
+  std::string StatsFile;
+  // report the time spent in every phase at the end of the TU
+  bool TimeSummary = false;
+  // give up locking an output file after this many seconds and spill the
+  // records next to it instead, 0 to wait as long as it takes
+  unsigned LockWaitBudget = 0;
+  // if set, send the records of every TU to the perry-daemon listening on
+  // this socket, and only fall back to the other outputs if that fails
+  std::string DaemonSocket;
+  // if set, insert the records of every TU into this shared table, and only
+  // fall back to the other outputs if it is full, see perry-merge
+  std::string SharedTableFile;
+  // if set, keep the records of every TU here and reuse them as long as the
+  // TU does not change
+  std::string IncrementalDir;
+  // if set, keep summaries of headers here and skip analyzing headers that
+  // were summarized by an earlier TU
+  std::string HeaderCacheDir;
+  // leave decls in system headers out of the analysis
+  bool ScopeSkipSystem = false;
+  // if not empty, only analyze decls in files under one of these paths
+  std::vector<std::string> ScopeAllow;
+  // never analyze decls in files under these paths
+  std::vector<std::string> ScopeDeny;
+  // if set, hand the records of every TU to this instead of writing them
+  // anywhere, used by tools that run the analysis in process
+  std::function<void(const PerryResults &)> Sink;
+  // write the records on a thread of their own, overlapping with code
+  // generation, see perry-flush-join
+  bool AsyncFlush = false;
+  // keep the records of every TU apart in the database, or in units files
+  // next to Files, so that a TU analyzed again replaces its old records
+  bool Provenance = false;
+};
+
+// Turns ScopeAllow and ScopeDeny into real paths, as the paths of files are
+// compared to them, once before the options are used
+void canonicalizeScopePaths(PerryOutputOptions &Opts);
+
+// Writes the records of a TU to the outputs given by the options and reports
+// what it cost. It owns all it needs, so that it can run on a thread of its
+// own with AsyncFlush; it then has no DiagnosticsEngine, which must not be
+// used off the compiler's thread.
+class PerryResultsFlush {
 public:
-  PerryASTConsumer(clang::ASTContext &Context,
-                   clang::CompilerInstance &CI,
-                   const std::string &outFileSuccRet,
-                   const std::string &outFileApi,
-                   const std::string &outFileLoops,
-                   const std::string &outFileStructNames);
-  void HandleTranslationUnit(clang::ASTContext &Context) override;
+  PerryResultsFlush(PerryResults Results, const PerryOutputOptions &Opts,
+                    std::string ShardPath,
+                    std::shared_ptr<PerryTimers> Timers,
+                    clang::DiagnosticsEngine *D);
+  // write the records, then write statistics and print timers
+  void run();
 
 private:
-  clang::CompilerInstance &CI;
-  clang::ast_matchers::MatchFinder Matcher;
-  EnumMapTy EnumValToDecl;
-  std::map<std::string, uint64_t> SuccRetValMap;
-  LoopRangeSet Loops;
-  PerryEnumMatcher EnumMatcher;
-  PerryLoopMatcher LoopMatcher;
-  PerryVisitor Visitor;
-  std::string outFileSuccRet;
-  std::string outFileApi;
-  std::string outFileLoops;
-  std::string outFileStructNames;
-  std::set<std::string> FuncDec;
-  std::set<std::string> FuncDef;
-  std::set<PerryLoopItem> AllLoops;
-  std::set<std::string> periphStructNames;
+  PerryResults Results;
+  PerryOutputOptions Opts;
+  // where the shard of this TU goes if Opts.ShardDir is set
+  std::string ShardPath;
+  // null unless Opts.TimeSummary is set
+  std::shared_ptr<PerryTimers> Timers;
+  // null when running off the compiler's thread
+  clang::DiagnosticsEngine *D;
+  // one entry per updated output file, written out with -stats-file
+  std::vector<PerryCacheStats> Stats;
+  // the journal taken for compaction with Opts.Provenance, stored instead of
+  // Results if not empty
+  PerryUnits Compacted;
 
   enum CacheType {
     SuccRet = 0,
     Api,
     Loop,
-    StructName
+    StructName,
+    Database
   };
 
-  void updateCache(CacheType ty);
+  // false if the records went to neither the file nor a spill file
+  bool updateCache(CacheType ty);
+  void writeShard();
+  void appendJournal();
+  // next to the output files, where the daemon and perry-merge fold them in,
+  // for records the daemon or the shared table did not take
+  void spillResults();
+  void writeResults();
+  void writeStats();
+};
+
+// Records the macros every non-system header depends on from outside: those
+// it expands or tests that were defined elsewhere, or not at all. Along with
+// its content, their definitions at that point decide what a header declares,
+// so they are part of the key of its summary.
+class PerryHeaderMacroTracker : public clang::PPCallbacks {
+public:
+  // hashes of the names and definitions of the macros each header depends on
+  using DepMap = std::map<const clang::FileEntry *, std::set<uint64_t>>;
+
+  PerryHeaderMacroTracker(clang::Preprocessor &PP, DepMap &Deps);
+  void MacroExpands(const clang::Token &MacroNameTok,
+                    const clang::MacroDefinition &MD,
+                    clang::SourceRange Range,
+                    const clang::MacroArgs *Args) override;
+  void If(clang::SourceLocation Loc, clang::SourceRange ConditionRange,
+          ConditionValueKind ConditionValue) override;
+  void Elif(clang::SourceLocation Loc, clang::SourceRange ConditionRange,
+            ConditionValueKind ConditionValue,
+            clang::SourceLocation IfLoc) override;
+  void Ifdef(clang::SourceLocation Loc, const clang::Token &MacroNameTok,
+             const clang::MacroDefinition &MD) override;
+  void Ifndef(clang::SourceLocation Loc, const clang::Token &MacroNameTok,
+              const clang::MacroDefinition &MD) override;
+
+private:
+  clang::Preprocessor &PP;
+  DepMap &Deps;
+  // the non-system header of a file, null for anything else
+  llvm::DenseMap<clang::FileID, const clang::FileEntry *> Headers;
+  llvm::DenseMap<const clang::MacroInfo *, uint64_t> DefinitionHashes;
+
+  const clang::FileEntry *getHeader(clang::SourceLocation Loc);
+  uint64_t getDefinitionHash(const clang::IdentifierInfo *II,
+                             const clang::MacroInfo *MI);
+  // MI is the definition of II in effect at Loc, null if there is none
+  void record(clang::SourceLocation Loc, const clang::IdentifierInfo *II,
+              const clang::MacroInfo *MI);
+  // every identifier in the condition of an #if or #elif
+  void recordCondition(clang::SourceLocation Loc,
+                       clang::SourceRange ConditionRange);
+};
 
-  void SuccRetCacheLoader();
-  void ApiCacheLoader();
-  void LoopCacheLoader();
-  void StructCacheLoader();
+// ASTConsumer
+class PerryASTConsumer : public clang::ASTConsumer {
+public:
+  PerryASTConsumer(clang::ASTContext &Context,
+                   clang::CompilerInstance &CI,
+                   const PerryOutputOptions &Opts);
+  void HandleTranslationUnit(clang::ASTContext &Context) override;
+
+private:
+  clang::CompilerInstance &CI;
+  LoopRangeMap Loops;
+  PerryResults Results;
+  PerryVisitor Visitor;
+  PerryOutputOptions Opts;
+  // null unless Opts.TimeSummary is set
+  std::shared_ptr<PerryTimers> Timers;
 
-  void SuccRetCacheWriter();
-  void ApiCacheWriter();
-  void LoopCacheWriter();
-  void StructCacheWriter();
+  std::string getShardPath(llvm::StringRef Dir);
+  // hand the records to a PerryResultsFlush. This is done at the end of the
+  // TU and not on destruction, as clang leaks the consumer unless
+  // -disable-free is turned off.
+  void flush();
+  // visit the main file, the predefines buffer (with a null FileEntry) and all
+  // non-system headers entered while preprocessing
+  void forEachUserFile(
+    llvm::function_ref<void(const clang::FileEntry *, llvm::StringRef)> Fn);
+  // hash of the main file, all non-system headers it includes and the options
+  // that change the records
+  std::string getFingerprint();
+  // non-system headers whose summaries are reused, and the keys of the ones
+  // that get summarized by this TU
+  llvm::SmallPtrSet<const clang::FileEntry *, 16> MemoizedHeaders;
+  std::map<const clang::FileEntry *, std::string> HeaderKeys;
+  // filled while preprocessing if Opts.HeaderCacheDir is set
+  PerryHeaderMacroTracker::DepMap HeaderMacros;
+  std::string getHeaderSummaryPath(const std::string &RealPath,
+                                   const std::string &Key);
+  // load existing summaries of headers
+  void loadHeaderSummaries();
+  void storeHeaderSummaries(clang::ASTContext &Context);
+  // leave summarized headers and out-of-scope files out of the traversal
+  void setTraversalScope(clang::ASTContext &Context);
+  bool isInScope(clang::Decl *D);
+  bool isFileInScope(const clang::FileEntry *FE);
+  llvm::DenseMap<const clang::FileEntry *, bool> FileInScope;
+  // reuse stored records if the TU did not change since they were stored
+  bool loadIncremental(const std::string &EntryPath);
+  // resolve collected loop ranges into file/line/column records
+  void collectLoops();
+  std::string getTUName();
+  // relative paths are taken from the working directory of the compiler's
+  // file system, which is not the one of the process under perry-scan
+  std::error_code getRealPath(llvm::StringRef Path,
+                              llvm::SmallVectorImpl<char> &RealPath);
 
 public:
-  std::set<std::string> &getStructNames() { return periphStructNames; }
+  PerryResults &getResults() { return Results; }
+  std::shared_ptr<PerryTimers> getTimers() { return Timers; }
 };
 
 // PerryIncludeProcessor
@@ -203,12 +314,16 @@ private:
 // PerryPeriphStructDefProcessor
 class PerryPeriphStructDefProcessor : public clang::PPCallbacks {
 public:
-  PerryPeriphStructDefProcessor(std::set<std::string> &);
+  PerryPeriphStructDefProcessor(PerryResults &,
+                                std::shared_ptr<PerryTimers> Timers = nullptr);
   void MacroExpands(const clang::Token &MacroNameTok,
                     const clang::MacroDefinition &MD,
                     clang::SourceRange Range,
                     const clang::MacroArgs *Args) override;
 
 private:
-  std::set<std::string> &periphStructNames;
+  PerryResults &Results;
+  std::shared_ptr<PerryTimers> Timers;
+  // macro definitions already looked at
+  llvm::SmallPtrSet<const clang::MacroInfo *, 64> ClassifiedMacros;
 };
\ No newline at end of file
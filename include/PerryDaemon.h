@@ -0,0 +1,26 @@
+#pragma once
+
+#include "PerryResults.h"
+
+// Talking to perry-daemon over its Unix domain socket.
+//
+// A client connects, sends a single request and shuts down its side of the
+// connection. The daemon handles the request, answers "ok" or "error" and
+// closes the connection. A request is a verb on its own line:
+//  * records:  followed by the records of a TU in shard format
+//  * flush:    write the output files now
+//  * shutdown: write the output files and exit
+static constexpr const char *PerryDaemonRecords = "records";
+static constexpr const char *PerryDaemonFlush = "flush";
+static constexpr const char *PerryDaemonShutdown = "shutdown";
+static constexpr const char *PerryDaemonOk = "ok";
+static constexpr const char *PerryDaemonError = "error";
+
+// Send the records of a TU, returns false if the daemon did not take them
+bool DaemonSendRecords(const std::string &Socket, const PerryResults &R);
+// Send a request without payload, returns false if it did not succeed
+bool DaemonSendCommand(const std::string &Socket, llvm::StringRef Verb);
+
+// Socket I/O shared with perry-daemon, retrying on EINTR and short transfers
+bool DaemonReadAll(int FD, std::string &Buffer);
+bool DaemonWriteAll(int FD, llvm::StringRef Buffer);
@@ -0,0 +1,243 @@
+#pragma once
+
+// Binary index of the Perry results, written by perry-merge -out-file-index.
+//
+// The file is a header followed by sections, each aligned to 8 bytes:
+//  * Strings: all interned strings, referenced by (offset, length)
+//  * Apis:    API names, sorted
+//  * SuccRet: (function name, success value), sorted by name
+//  * Files:   (path, first loop, number of loops), sorted by path
+//  * Loops:   loop ranges, grouped by file in the order of Files
+//  * Structs: peripheral struct names, sorted
+// Integers are stored in the byte order of the writer, which is recorded in
+// the header.
+//
+// This header is self-contained so Perry can use the reader without linking
+// anything from the plugin. Lookups never allocate.
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static constexpr char PerryIndexMagic[8] = {'P', 'E', 'R', 'R',
+                                            'Y', 'I', 'D', 'X'};
+static constexpr uint32_t PerryIndexVersion = 1;
+static constexpr uint32_t PerryIndexByteOrder = 0x01020304;
+
+enum PerryIndexSectionKind {
+  PIS_Strings = 0,
+  PIS_Apis,
+  PIS_SuccRet,
+  PIS_Files,
+  PIS_Loops,
+  PIS_Structs,
+  PIS_NumSections
+};
+
+struct PerryIndexSection {
+  uint64_t Offset;
+  uint64_t Size;
+  uint64_t Count;
+};
+
+struct PerryIndexHeader {
+  char Magic[8];
+  uint32_t Version;
+  uint32_t ByteOrder;
+  PerryIndexSection Sections[PIS_NumSections];
+};
+
+struct PerryIndexString {
+  uint32_t Offset;
+  uint32_t Length;
+};
+
+struct PerryIndexSuccRet {
+  PerryIndexString Func;
+  uint64_t SuccVal;
+};
+
+struct PerryIndexFile {
+  PerryIndexString Path;
+  uint32_t FirstLoop;
+  uint32_t NumLoops;
+};
+
+struct PerryIndexLoop {
+  uint32_t BeginLine;
+  uint32_t BeginColumn;
+  uint32_t EndLine;
+  uint32_t EndColumn;
+};
+
+// Read-only view of a mapped index
+class PerryIndexReader {
+public:
+  PerryIndexReader() = default;
+  PerryIndexReader(const PerryIndexReader &) = delete;
+  PerryIndexReader &operator=(const PerryIndexReader &) = delete;
+  ~PerryIndexReader() { close(); }
+
+  // map the index at Path, returns false if it is missing or malformed
+  bool open(const char *Path) {
+    close();
+    int FD = ::open(Path, O_RDONLY);
+    if (FD < 0) {
+      return false;
+    }
+    struct stat St;
+    if (::fstat(FD, &St) || St.st_size < (off_t)sizeof(PerryIndexHeader)) {
+      ::close(FD);
+      return false;
+    }
+    void *Addr = ::mmap(nullptr, St.st_size, PROT_READ, MAP_PRIVATE, FD, 0);
+    ::close(FD);
+    if (Addr == MAP_FAILED) {
+      return false;
+    }
+    Base = static_cast<const char *>(Addr);
+    Size = St.st_size;
+    if (!validate()) {
+      close();
+      return false;
+    }
+    return true;
+  }
+
+  void close() {
+    if (Base) {
+      ::munmap(const_cast<char *>(Base), Size);
+    }
+    Base = nullptr;
+    Size = 0;
+  }
+
+  bool isOpen() const { return Base != nullptr; }
+
+  // is Func a potential API
+  bool isApi(std::string_view Func) const {
+    auto *Begin = section<PerryIndexString>(PIS_Apis);
+    auto *End = Begin + count(PIS_Apis);
+    auto It = lowerBound(Begin, End, Func,
+                         [](const PerryIndexString &S) { return S; });
+    return It != End && str(*It) == Func;
+  }
+
+  // success return value of Func, if there is one
+  bool getSuccRet(std::string_view Func, uint64_t &SuccVal) const {
+    auto *Begin = section<PerryIndexSuccRet>(PIS_SuccRet);
+    auto *End = Begin + count(PIS_SuccRet);
+    auto It = lowerBound(Begin, End, Func,
+                         [](const PerryIndexSuccRet &S) { return S.Func; });
+    if (It == End || str(It->Func) != Func) {
+      return false;
+    }
+    SuccVal = It->SuccVal;
+    return true;
+  }
+
+  // loops in the file at Path (canonical, as in the YAML output)
+  std::pair<const PerryIndexLoop *, const PerryIndexLoop *>
+  getLoops(std::string_view Path) const {
+    auto *Begin = section<PerryIndexFile>(PIS_Files);
+    auto *End = Begin + count(PIS_Files);
+    auto It = lowerBound(Begin, End, Path,
+                         [](const PerryIndexFile &F) { return F.Path; });
+    if (It == End || str(It->Path) != Path) {
+      return {nullptr, nullptr};
+    }
+    auto *Loops = section<PerryIndexLoop>(PIS_Loops) + It->FirstLoop;
+    return {Loops, Loops + It->NumLoops};
+  }
+
+  // is Name a peripheral struct
+  bool isPeriphStruct(std::string_view Name) const {
+    auto *Begin = section<PerryIndexString>(PIS_Structs);
+    auto *End = Begin + count(PIS_Structs);
+    auto It = lowerBound(Begin, End, Name,
+                         [](const PerryIndexString &S) { return S; });
+    return It != End && str(*It) == Name;
+  }
+
+  // raw access to the sections, e.g., to iterate over all records
+  template<typename T>
+  const T *section(PerryIndexSectionKind Kind) const {
+    return reinterpret_cast<const T *>(Base + header()->Sections[Kind].Offset);
+  }
+  uint64_t count(PerryIndexSectionKind Kind) const {
+    return header()->Sections[Kind].Count;
+  }
+  std::string_view str(const PerryIndexString &S) const {
+    return std::string_view(section<char>(PIS_Strings) + S.Offset, S.Length);
+  }
+
+private:
+  const char *Base = nullptr;
+  size_t Size = 0;
+
+  const PerryIndexHeader *header() const {
+    return reinterpret_cast<const PerryIndexHeader *>(Base);
+  }
+
+  bool validate() const {
+    auto *H = header();
+    if (std::memcmp(H->Magic, PerryIndexMagic, sizeof(PerryIndexMagic)) ||
+        H->Version != PerryIndexVersion ||
+        H->ByteOrder != PerryIndexByteOrder) {
+      return false;
+    }
+    static const size_t RecordSize[PIS_NumSections] = {
+      1, sizeof(PerryIndexString), sizeof(PerryIndexSuccRet),
+      sizeof(PerryIndexFile), sizeof(PerryIndexLoop), sizeof(PerryIndexString)
+    };
+    for (unsigned i = 0; i < PIS_NumSections; ++i) {
+      const PerryIndexSection &S = H->Sections[i];
+      if (S.Offset % 8 || S.Offset > Size || S.Size > Size - S.Offset ||
+          S.Count > S.Size / RecordSize[i]) {
+        return false;
+      }
+    }
+    // every record has to stay within the sections it refers to, so that
+    // lookups never read outside the mapping
+    auto Fits = [&](const PerryIndexString &S) {
+      return S.Offset <= count(PIS_Strings) &&
+             S.Length <= count(PIS_Strings) - S.Offset;
+    };
+    PerryIndexSectionKind Names[] = {PIS_Apis, PIS_Structs};
+    for (auto Kind : Names) {
+      auto *Strings = section<PerryIndexString>(Kind);
+      if (!std::all_of(Strings, Strings + count(Kind), Fits)) {
+        return false;
+      }
+    }
+    auto *SuccRet = section<PerryIndexSuccRet>(PIS_SuccRet);
+    if (!std::all_of(SuccRet, SuccRet + count(PIS_SuccRet),
+                     [&](const PerryIndexSuccRet &S) {
+                       return Fits(S.Func);
+                     })) {
+      return false;
+    }
+    auto *Files = section<PerryIndexFile>(PIS_Files);
+    return std::all_of(Files, Files + count(PIS_Files),
+                       [&](const PerryIndexFile &F) {
+                         return Fits(F.Path) &&
+                                F.FirstLoop <= count(PIS_Loops) &&
+                                F.NumLoops <= count(PIS_Loops) - F.FirstLoop;
+                       });
+  }
+
+  template<typename T, typename KeyFn>
+  const T *lowerBound(const T *Begin, const T *End, std::string_view Key,
+                      KeyFn GetKey) const {
+    return std::lower_bound(Begin, End, Key,
+                            [&](const T &Rec, std::string_view K) {
+                              return str(GetKey(Rec)) < K;
+                            });
+  }
+};
@@ -0,0 +1,232 @@
+#pragma once
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Allocator.h"
+
+#include <functional>
+#include <map>
+#include <string>
+#include <tuple>
+#include <vector>
+
+// Interns the names and file paths of a result set. Every string is stored
+// once in a bump allocator and referred to by a dense id.
+class PerryStringTable {
+public:
+  PerryStringTable() = default;
+  PerryStringTable(PerryStringTable &&) = default;
+  PerryStringTable &operator=(PerryStringTable &&) = default;
+  PerryStringTable(const PerryStringTable &Other) { *this = Other; }
+  PerryStringTable &operator=(const PerryStringTable &Other);
+
+  uint32_t intern(llvm::StringRef S);
+  // false if S was never interned
+  bool find(llvm::StringRef S, uint32_t &Id) const;
+  llvm::StringRef get(uint32_t Id) const { return Strings[Id]; }
+  size_t size() const { return Strings.size(); }
+
+private:
+  llvm::StringMap<uint32_t, llvm::BumpPtrAllocator> Ids;
+  // keys of Ids, which never move
+  std::vector<llvm::StringRef> Strings;
+};
+
+// Kinds of records naming a function or a struct
+enum PerryNameKind : uint8_t {
+  PNK_SuccRet = 1 << 0,
+  PNK_FuncDec = 1 << 1,
+  PNK_FuncDef = 1 << 2,
+  PNK_StructName = 1 << 3,
+  // APIs are functions both declared in headers and defined
+  PNK_Api = PNK_FuncDec | PNK_FuncDef
+};
+
+// The records naming a string of the table
+struct PerryNameRecord {
+  uint64_t SuccVal = 0;
+  uint8_t Kinds = 0;
+};
+
+struct PerryLoopItem {
+  // id of the file path in the string table
+  uint32_t File;
+  unsigned beginLine;
+  unsigned beginColumn;
+  unsigned endLine;
+  unsigned endColumn;
+
+  bool operator==(const PerryLoopItem &PI) const {
+    return File == PI.File && beginLine == PI.beginLine &&
+           beginColumn == PI.beginColumn && endLine == PI.endLine &&
+           endColumn == PI.endColumn;
+  }
+
+  bool operator<(const PerryLoopItem &PI) const {
+    return std::tie(File, beginLine, beginColumn, endLine, endColumn) <
+           std::tie(PI.File, PI.beginLine, PI.beginColumn, PI.endLine,
+                    PI.endColumn);
+  }
+};
+
+// Everything the plugin collects, either for a single translation unit or
+// accumulated over many of them. Names are flags on the interned strings and
+// loops are a flat vector, so the records of a large SDK take a few
+// allocations instead of one node each.
+struct PerryResults {
+  // identifies the translation unit the records come from, empty when the
+  // results are accumulated
+  std::string TU;
+  // the output file of the compilation of TU, if any. The same source may be
+  // compiled more than once into different outputs
+  std::string Output;
+  // hash of the content the records were produced from, if known
+  std::string Fingerprint;
+  PerryStringTable Strings;
+  // indexed by string id
+  std::vector<PerryNameRecord> Names;
+  // sorted and without duplicates, except while adding loops one by one
+  std::vector<PerryLoopItem> AllLoops;
+
+  uint32_t intern(llvm::StringRef S);
+  // the first success value of a function wins
+  void addSuccRet(llvm::StringRef Func, uint64_t SuccVal);
+  void addName(llvm::StringRef Name, uint8_t Kinds);
+  void addFuncDec(llvm::StringRef Func) { addName(Func, PNK_FuncDec); }
+  void addFuncDef(llvm::StringRef Func) { addName(Func, PNK_FuncDef); }
+  void addStructName(llvm::StringRef Name) { addName(Name, PNK_StructName); }
+  // call sortLoops() once done adding
+  void addLoop(llvm::StringRef File, unsigned beginLine, unsigned beginColumn,
+               unsigned endLine, unsigned endColumn);
+  void sortLoops();
+
+  bool hasSuccRet(llvm::StringRef Func) const;
+  bool getSuccRet(llvm::StringRef Func, uint64_t &SuccVal) const;
+  // number of names with all of Kinds
+  size_t count(uint8_t Kinds) const;
+  // ids of the names with all of Kinds, ordered by name
+  std::vector<uint32_t> getNames(uint8_t Kinds) const;
+  // loops ordered by file path and position, visited in runs of one file
+  void forEachFileLoops(
+    llvm::function_ref<void(llvm::StringRef,
+                            llvm::ArrayRef<PerryLoopItem>)> Fn) const;
+
+  // union records of another result set into this one. Without SortLoops,
+  // call sortLoops() once done merging.
+  void merge(const PerryResults &Other, bool SortLoops = true);
+  // a copy with the names having any of Kinds, limited to those kinds, and
+  // the loops if Loops is set, i.e., what one of the output files holds
+  PerryResults select(uint8_t Kinds, bool Loops) const;
+};
+
+// Records kept apart by the translation unit that produced them, told apart by
+// TU and Output as shards are. Storing the records of a TU again replaces what
+// it contributed before, so functions and loops removed from the source go
+// away without a clean rebuild. Records of no known TU, e.g., from files
+// written before, are kept under the empty key and only ever added to.
+struct PerryUnits {
+  std::map<std::string, PerryResults> Units;
+
+  // replace the records of R.TU and R.Output with R
+  void replace(PerryResults R);
+  // keep the records of Found that no unit holds under the empty key
+  void seed(const PerryResults &Found);
+  // union the records of all TUs into R
+  void combine(PerryResults &R) const;
+};
+
+// Paths to the four YAML files consumed by Perry
+struct PerryOutputFiles {
+  std::string SuccRet;
+  std::string Api;
+  std::string Loops;
+  std::string StructNames;
+};
+
+// Loaders union the content of an existing file into the results. They return
+// false if the file exists but cannot be read.
+bool SuccRetCacheLoader(const std::string &Path, PerryResults &R);
+bool ApiCacheLoader(const std::string &Path, PerryResults &R);
+bool LoopCacheLoader(const std::string &Path, PerryResults &R);
+bool StructCacheLoader(const std::string &Path, PerryResults &R);
+
+// Writers replace the file with the content of the results by renaming a
+// complete temporary file over it, so readers never need the lock. They return
+// false if the file cannot be written, leaving the old file in place.
+bool SuccRetCacheWriter(const std::string &Path, const PerryResults &R);
+bool ApiCacheWriter(const std::string &Path, const PerryResults &R);
+bool LoopCacheWriter(const std::string &Path, const PerryResults &R);
+bool StructCacheWriter(const std::string &Path, const PerryResults &R);
+
+// A shard holds all records of a single translation unit in one YAML file.
+// Shards are written by the plugin without locking and combined by perry-merge.
+// The loader takes TU and Fingerprint from the shard as well.
+bool ShardLoader(const std::string &Path, PerryResults &R);
+bool ShardWriter(const std::string &Path, const PerryResults &R);
+
+// The database holds the accumulated records of all four kinds in a single
+// file, in the same format as a shard. Updating it takes one lock per TU
+// instead of four, perry-merge exports it to the four files. With -provenance
+// it is a units file instead, the loader reads either.
+bool DatabaseLoader(const std::string &Path, PerryResults &R);
+bool DatabaseWriter(const std::string &Path, const PerryResults &R);
+
+// A units file is a stream of shards, one per TU. The loader keeps the last
+// shard of every TU, shards without a TU are unioned. Databases and journals
+// are read this way, and so are the files next to the output files that
+// -provenance keeps, named by getUnitsPath.
+bool UnitsLoader(const std::string &Path, PerryUnits &U);
+bool UnitsWriter(const std::string &Path, const PerryUnits &U);
+std::string getUnitsPath(const std::string &Path);
+// Whether the units file of Path holds all records in Path. An update with
+// -provenance writes it right after Path; anything else writing Path, e.g., a
+// TU without -provenance, the shared table fallback or perry-merge, leaves it
+// behind, and the records it is missing should be seeded from Path.
+bool isUnitsFileCurrent(const std::string &Path);
+
+// A TU that cannot lock an output file in time writes its records to a spill
+// file next to it instead, using the writer of that file. Spill files are
+// folded in by the next TU taking the lock, or by perry-merge.
+bool SpillWriter(
+  const std::string &Path,
+  const std::function<bool(const std::string &, const PerryResults &)> &Writer,
+  const PerryResults &R);
+// the same for a units file
+bool SpillWriter(const std::string &Path, const PerryUnits &U);
+// spill files written for Path
+std::vector<std::string> getSpillFiles(const std::string &Path);
+
+// Serialize the records in shard format, e.g., to send them elsewhere, and
+// union one or more serialized documents into the results
+std::string ShardToString(const PerryResults &R);
+bool ShardFromString(llvm::StringRef Buffer, PerryResults &R);
+
+// The journal is an append-only stream of shards. Every TU appends its records
+// with a single write and never reads the journal back; compaction folds it
+// into the four files either once the build is done, or when it grows too big.
+// Loading it into results unions all entries. Loading it into units keeps the
+// last entry of every TU, which is what -provenance wants.
+bool JournalLoader(const std::string &Path, PerryResults &R);
+bool JournalAppend(const std::string &Path, const PerryResults &R);
+// Move the journal aside and read it. Taken names the moved file, which should
+// be removed once its records are stored elsewhere. Taken is empty if there is
+// no journal to compact.
+bool JournalTake(const std::string &Path, PerryUnits &U, std::string &Taken);
+bool JournalTake(const std::string &Path, PerryResults &R, std::string &Taken);
+
+// The shared table is a file mapped by all compiler processes at once. Each
+// TU inserts its records into lock-free hash tables in it, perry-merge exports
+// them to the four files. The insert returns false if the table is full.
+bool SharedTableInsert(const std::string &Path, const PerryResults &R);
+bool SharedTableLoader(const std::string &Path, PerryResults &R);
+
+// Append a line of statistics in a single write, see perry-stats
+bool StatsAppend(const std::string &Path, llvm::StringRef Line);
+
+// Write the binary index read by PerryIndexReader, see PerryIndex.h
+bool IndexWriter(const std::string &Path, const PerryResults &R);
+
+// Name of the shard file for a translation unit, stable across rebuilds
+std::string getShardFileName(llvm::StringRef TU, llvm::StringRef OutputFile);
@@ -1,57 +1,43 @@
 #include "PerryClangPlugin.h"
+#include "PerryDaemon.h"
 
 #include "clang/Frontend/FrontendPluginRegistry.h"
 #include "clang/Lex/MacroArgs.h"
+#include "clang/Lex/Lexer.h"
+#include "clang/Lex/Preprocessor.h"
 
-#include "llvm/Support/YAMLParser.h"
-#include "llvm/Support/YAMLTraits.h"
-#include "llvm/Support/MemoryBuffer.h"
 #include "llvm/Support/LockFileManager.h"
 #include "llvm/Support/Compiler.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/xxhash.h"
+#include "llvm/ADT/StringExtras.h"
 
-using namespace clang;
-using namespace ast_matchers;
-
-// PerryEnumMatcher
-PerryEnumMatcher::PerryEnumMatcher(EnumMapTy &EnumValToDecl)
-  : EnumValToDecl(EnumValToDecl) {}
-
-void PerryEnumMatcher::run(const MatchFinder::MatchResult &Result) {
-  const EnumDecl *EnumDef = Result.Nodes.getNodeAs<EnumDecl>("EnumDef");
-  if (!EnumDef) {
-    return;
-  }
-
-  for (const EnumConstantDecl *EnumVal : EnumDef->enumerators()) {
-    if (EnumValToDecl.find(EnumVal) == EnumValToDecl.end()) {
-      EnumValToDecl.insert(std::make_pair(EnumVal, EnumDef));
-    }
-  }
-}
-
-PerryLoopMatcher::
-PerryLoopMatcher(SourceManager &SM, LoopRangeSet &Loops)
-  : SM(SM), Loops(Loops) {}
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <thread>
 
-void PerryLoopMatcher::run(const MatchFinder::MatchResult &Result) {
-  const ForStmt *ForLoop = Result.Nodes.getNodeAs<ForStmt>("ForLoop");
-  const WhileStmt *WhileLoop = Result.Nodes.getNodeAs<WhileStmt>("WhileLoop");
-  const DoStmt *DoWhileLoop = Result.Nodes.getNodeAs<DoStmt>("DoWhileLoop");
-  if (ForLoop) {
-    Loops.insert(std::make_pair(ForLoop->getForLoc().getRawEncoding(),
-                                ForLoop->getRParenLoc().getRawEncoding()));
-  }
+using namespace clang;
 
-  if (WhileLoop) {
-    Loops.insert(std::make_pair(WhileLoop->getWhileLoc().getRawEncoding(),
-                                WhileLoop->getRParenLoc().getRawEncoding()));
-  }
+// A phase of the plugin, traced for -ftime-trace and timed by T if given
+class PerryPhase {
+public:
+  PerryPhase(StringRef Name, StringRef Detail, llvm::Timer *T)
+    : Trace(Name, Detail), Region(T) {}
 
-  if (DoWhileLoop) {
-    Loops.insert(std::make_pair(DoWhileLoop->getBody()->getEndLoc().getRawEncoding(),
-                                DoWhileLoop->getRParenLoc().getRawEncoding()));
-  }
+private:
+  llvm::TimeTraceScope Trace;
+  llvm::TimeRegion Region;
+};
 
+// the enum an enum constant belongs to
+static const EnumDecl *getEnumDecl(const EnumConstantDecl *EnumVal) {
+  return cast<EnumDecl>(EnumVal->getDeclContext());
 }
 
 // PerryVisitor implementation
@@ -67,73 +53,67 @@ bool PerryVisitor::isGoodEnumName(const llvm::StringRef &Name) {
   return false;
 }
 
-bool PerryVisitor::TraverseFunctionDecl(FunctionDecl *FD) {
+void PerryVisitor::recordSuccRet(const std::string &FuncName,
+                                 const EnumDecl *ED) {
+  for (auto EnumVal : ED->enumerators()) {
+    // indicating success
+    if (isGoodEnumName(EnumVal->getName())) {
+      Results.addSuccRet(FuncName, EnumVal->getInitVal().getZExtValue());
+      break;
+    }
+  }
+}
+
+bool PerryVisitor::recordFunction(FunctionDecl *FD,
+                                  const std::string &FuncName) {
   // do nothing when the function:
   //  a) does not return, or
   if (FD->isNoReturn()) {
-    return true;
+    return false;
   }
   //  b) has no implementation body
-  std::string FuncName = FD->getNameAsString();
   bool inMainFile = Context->getSourceManager()
                       .isInMainFile(FD->getSourceRange().getBegin());
   bool inSystemFile = Context->getSourceManager()
                       .isInSystemHeader(FD->getSourceRange().getBegin());
   if (!FD->hasBody()) {
     if (!inMainFile && !inSystemFile) {
-      FuncDec.insert(FuncName);
+      Results.addFuncDec(FuncName);
     }
-    return true;
+    return false;
   }
 
   // the function has a body
   if (inMainFile) {
-    FuncDef.insert(FuncName);
+    Results.addFuncDef(FuncName);
   } else if (!inSystemFile) {
-    FuncDec.insert(FuncName);
+    Results.addFuncDec(FuncName);
   }
 
   // have we analyzed this function?
-  if (SuccRetValMap.find(FuncName) != SuccRetValMap.end()) {
-    return true;
+  if (Results.hasSuccRet(FuncName)) {
+    return false;
   }
 
   QualType RetType = FD->getDeclaredReturnType();
   // if the function returns an enum according to signature, take the fast path
   if (RetType->isEnumeralType()) {
     const EnumType *RetEnumType = cast<EnumType>(RetType.getCanonicalType());
-    for (auto EnumVal : RetEnumType->getDecl()->enumerators()) {
-      // indicating success
-      if (isGoodEnumName(EnumVal->getName())) {
-        SuccRetValMap.insert(
-          std::make_pair(FuncName,EnumVal->getInitVal().getZExtValue()));
-        break;
-      }
-    }
-    return true;
+    recordSuccRet(FuncName, RetEnumType->getDecl());
+    return false;
   }
-  // else, take the slow path
-  // clear placeholders
-  retEnum.clear();
-  retVar.clear();
-  varDeclWithEnum.clear();
-  varStoredWithEnum.clear();
-  // traverse function body, visitors will be invoked along the way
-  auto Ret = RecursiveASTVisitor::TraverseStmt(FD->getBody());
-  // process data
+  // else, take the slow path while traversing the body
+  return true;
+}
+
+void PerryVisitor::analyzeReturns(const std::string &FuncName) {
   if (!retEnum.empty()) {
     // returns an enum
     if (retEnum.size() > 1) {
       llvm::errs() << "In " << FuncName << ": multiple return enum types.\n";
     }
     for (auto ED : retEnum) {
-      for (auto EnumVal : ED->enumerators()) {
-        if (isGoodEnumName(EnumVal->getName())) {
-          SuccRetValMap.insert(
-            std::make_pair(FuncName,EnumVal->getInitVal().getZExtValue()));
-          break;
-        }
-      }
+      recordSuccRet(FuncName, ED);
     }
   } else if (!retVar.empty()){
     // returns a local var
@@ -151,39 +131,58 @@ bool PerryVisitor::TraverseFunctionDecl(FunctionDecl *FD) {
         llvm::errs() << "In " << FuncName << ": multiple return enum types.\n";
       }
       for (auto ED : collectedEnum) {
-        for (auto EnumVal : ED->enumerators()) {
-          if (isGoodEnumName(EnumVal->getName())) {
-            SuccRetValMap.insert(
-              std::make_pair(FuncName,
-                                EnumVal->getInitVal().getZExtValue()));
-            break;
-          }
-        }
+        recordSuccRet(FuncName, ED);
       }
     }
   }
+}
+
+bool PerryVisitor::TraverseFunctionDecl(FunctionDecl *FD) {
+  std::string FuncName = FD->getNameAsString();
+  bool analyze = recordFunction(FD, FuncName);
+  // the body is traversed once, from the declaration it belongs to, and loops
+  // are collected along the way even if there is nothing else to analyze
+  if (!FD->doesThisDeclarationHaveABody()) {
+    return true;
+  }
+  // clear placeholders
+  retEnum.clear();
+  retVar.clear();
+  varDeclWithEnum.clear();
+  varStoredWithEnum.clear();
+  // traverse function body, visitors will be invoked along the way
+  auto Ret = RecursiveASTVisitor::TraverseStmt(FD->getBody());
+  // process data
+  if (analyze) {
+    analyzeReturns(FuncName);
+  }
   return Ret;
 }
 
 // case a) Initialize using an enum constant
 bool PerryVisitor::TraverseVarDecl(VarDecl *VD) {
   // only focus on local vars
-  if (!VD->isLocalVarDecl()) {
-    return true;
+  if (!VD->isLocalVarDecl() || !VD->hasInit() ||
+      VD->getInitStyle() != VarDecl::CInit) {
+    return RecursiveASTVisitor::TraverseVarDecl(VD);
   }
-  if (VD->hasInit() && VD->getInitStyle() == VarDecl::CInit) {
-    refVal = nullptr;
-    auto Ret = RecursiveASTVisitor::TraverseStmt(VD->getInit());
-    if (refVal) {
-      EnumConstantDecl *enumVal = dyn_cast<EnumConstantDecl>(refVal);
-      if (enumVal) {
-        // init using an enum
-        auto it = EnumValToDecl.find(enumVal);
-        assert(it != EnumValToDecl.end());
-        varDeclWithEnum.insert(std::make_pair(VD, (*it).second));
-      }
+  // the type is walked on its own, so that only the initializer is inspected
+  if (!WalkUpFromVarDecl(VD)) {
+    return false;
+  }
+  if (TypeSourceInfo *TSI = VD->getTypeSourceInfo()) {
+    if (!TraverseTypeLoc(TSI->getTypeLoc())) {
+      return false;
     }
-    return Ret;
+  }
+  refVal = nullptr;
+  if (!RecursiveASTVisitor::TraverseStmt(VD->getInit())) {
+    return false;
+  }
+  EnumConstantDecl *enumVal = dyn_cast_or_null<EnumConstantDecl>(refVal);
+  if (enumVal) {
+    // init using an enum
+    varDeclWithEnum.insert(std::make_pair(VD, getEnumDecl(enumVal)));
   }
   return true;
 }
@@ -196,9 +195,7 @@ bool PerryVisitor::TraverseReturnStmt(ReturnStmt *RS) {
     EnumConstantDecl *enumVal = dyn_cast<EnumConstantDecl>(refVal);
     if (enumVal) {
       // returns an enum
-      auto it = EnumValToDecl.find(enumVal);
-      assert(it != EnumValToDecl.end());
-      retEnum.insert((*it).second);
+      retEnum.insert(getEnumDecl(enumVal));
     } else {
       VarDecl *target = dyn_cast<VarDecl>(refVal);
       if (target && target->isLocalVarDecl()) {
@@ -212,37 +209,30 @@ bool PerryVisitor::TraverseReturnStmt(ReturnStmt *RS) {
 
 // case c) Assign with an enum constant
 bool PerryVisitor::TraverseBinaryOperator(BinaryOperator *BO) {
-  if (BO->getOpcode() == BO_Assign) {
-    refVal = nullptr;
-    auto Ret = RecursiveASTVisitor::TraverseStmt(BO->getRHS());
-    if (!Ret) {
-      return false;
-    }
-    const EnumDecl *enumDef = nullptr;
-    if (refVal) {
-      EnumConstantDecl *enumVal = dyn_cast<EnumConstantDecl>(refVal);
-      if (enumVal) {
-        auto it = EnumValToDecl.find(enumVal);
-        assert(it != EnumValToDecl.end());
-        enumDef = (*it).second;
-      }
-    }
-    if (enumDef) {
-      refVal = nullptr;
-      Ret = RecursiveASTVisitor::TraverseStmt(BO->getLHS());
-      if (!Ret) {
-        return false;
-      }
-      if (refVal) {
-        VarDecl *target = dyn_cast<VarDecl>(refVal);
-        if (target && target->isLocalVarDecl()) {
-          // stores an enum
-          varStoredWithEnum.insert(std::make_pair(target, enumDef));
-        }
-      }
-    }
+  if (BO->getOpcode() != BO_Assign) {
+    // only walked for the loops inside, the decls it refers to are not what
+    // a return, an initializer or an assignment around it yields
+    ValueDecl *Saved = refVal;
+    auto Ret = RecursiveASTVisitor::TraverseBinaryOperator(BO);
+    refVal = Saved;
     return Ret;
   }
+  // each side is traversed once, in order, noting the last decl it refers to
+  refVal = nullptr;
+  if (!RecursiveASTVisitor::TraverseStmt(BO->getLHS())) {
+    return false;
+  }
+  ValueDecl *lhsVal = refVal;
+  refVal = nullptr;
+  if (!RecursiveASTVisitor::TraverseStmt(BO->getRHS())) {
+    return false;
+  }
+  EnumConstantDecl *enumVal = dyn_cast_or_null<EnumConstantDecl>(refVal);
+  VarDecl *target = dyn_cast_or_null<VarDecl>(lhsVal);
+  if (enumVal && target && target->isLocalVarDecl()) {
+    // stores an enum
+    varStoredWithEnum.insert(std::make_pair(target, getEnumDecl(enumVal)));
+  }
   return true;
 }
 
@@ -251,122 +241,121 @@ bool PerryVisitor::VisitDeclRefExpr(DeclRefExpr *DRE) {
   return true;
 }
 
-// YAML I/O
-struct PerryFuncRetItem {
-  std::string FuncName;
-  uint64_t SuccVal;
-  PerryFuncRetItem(const std::string &FuncName, uint64_t SuccVal)
-    : FuncName(FuncName), SuccVal(SuccVal) {}
-  PerryFuncRetItem() = default;
-};
-
-struct PerryApiItem {
-  std::string FuncName;
-  PerryApiItem(const std::string &FuncName) : FuncName(FuncName) {}
-  PerryApiItem() = default;
-};
-
-template<>
-struct llvm::yaml::MappingTraits<PerryFuncRetItem> {
-  static void mapping(IO &io, PerryFuncRetItem &item) {
-    io.mapRequired("func", item.FuncName);
-    io.mapRequired("succ_val", item.SuccVal);
+void PerryVisitor::recordLoop(SourceLocation Begin, SourceLocation End) {
+  // loops spelled in macros are left out
+  if (!Begin.isValid() || !End.isValid() ||
+      !Begin.isFileID() || !End.isFileID()) {
+    return;
   }
-};
-
-template<>
-struct llvm::yaml::MappingTraits<PerryApiItem> {
-  static void mapping(IO &io, PerryApiItem &item) {
-    io.mapRequired("api", item.FuncName);
+  auto &SM = Context->getSourceManager();
+  auto B = SM.getDecomposedLoc(Begin);
+  auto E = SM.getDecomposedLoc(End);
+  if (B.first != E.first) {
+    return;
   }
-};
+  Loops[B.first].push_back(std::make_pair(B.second, E.second));
+}
 
-template<>
-struct llvm::yaml::MappingTraits<PerryLoopItem> {
-  static void mapping(IO &io, PerryLoopItem &item) {
-    io.mapRequired("file", item.FilePath);
-    io.mapRequired("begin_line", item.beginLine);
-    io.mapRequired("begin_column", item.beginColumn);
-    io.mapRequired("end_line", item.endLine);
-    io.mapRequired("end_column", item.endColumn);
-  }
-};
+bool PerryVisitor::VisitForStmt(ForStmt *FS) {
+  recordLoop(FS->getForLoc(), FS->getRParenLoc());
+  return true;
+}
 
-LLVM_YAML_IS_SEQUENCE_VECTOR(PerryFuncRetItem)
-LLVM_YAML_IS_SEQUENCE_VECTOR(PerryApiItem)
-LLVM_YAML_IS_SEQUENCE_VECTOR(PerryLoopItem)
+bool PerryVisitor::VisitWhileStmt(WhileStmt *WS) {
+  recordLoop(WS->getWhileLoc(), WS->getRParenLoc());
+  return true;
+}
+
+bool PerryVisitor::VisitDoStmt(DoStmt *DS) {
+  recordLoop(DS->getBody()->getEndLoc(), DS->getRParenLoc());
+  return true;
+}
 
 // PerryASTConsumer implementation
 PerryASTConsumer::PerryASTConsumer(ASTContext &Context,
                                    CompilerInstance &CI,
-                                   const std::string &outFileSuccRet,
-                                   const std::string &outFileApi,
-                                   const std::string &outFileLoops,
-                                   const std::string &outFileStructNames)
-  : CI(CI), EnumMatcher(EnumValToDecl),
-    LoopMatcher(CI.getSourceManager(), Loops),
-    Visitor(&Context, SuccRetValMap, EnumValToDecl, FuncDec, FuncDef),
-    outFileSuccRet(outFileSuccRet),
-    outFileApi(outFileApi),
-    outFileLoops(outFileLoops),
-    outFileStructNames(outFileStructNames) {
-  // Enum
-  DeclarationMatcher EnumDef = enumDecl().bind("EnumDef");
-  Matcher.addMatcher(EnumDef, &EnumMatcher);
-
-  StatementMatcher ForLoop = forStmt().bind("ForLoop");
-  StatementMatcher WhileLoop = whileStmt().bind("WhileLoop");
-  StatementMatcher DoWhileLoop = doStmt().bind("DoWhileLoop");
-  Matcher.addMatcher(ForLoop, &LoopMatcher);
-  Matcher.addMatcher(WhileLoop, &LoopMatcher);
-  Matcher.addMatcher(DoWhileLoop, &LoopMatcher);
-}
-
-void PerryASTConsumer::updateCache(CacheType ty) {
-  DiagnosticsEngine &D = CI.getDiagnostics();
-  std::string CacheName;
-  std::function<void(PerryASTConsumer*)> loader;
-  std::function<void(PerryASTConsumer*)> writer;
-  switch (ty) {
-    case SuccRet:
-      CacheName = outFileSuccRet;
-      loader = &PerryASTConsumer::SuccRetCacheLoader;
-      writer = &PerryASTConsumer::SuccRetCacheWriter;
-      break;
-    case Api:
-      CacheName = outFileApi;
-      loader = &PerryASTConsumer::ApiCacheLoader;
-      writer = &PerryASTConsumer::ApiCacheWriter;
-      break;
-    case Loop:
-      CacheName = outFileLoops;
-      loader = &PerryASTConsumer::LoopCacheLoader;
-      writer = &PerryASTConsumer::LoopCacheWriter;
-      break;
-    case StructName:
-      CacheName = outFileStructNames;
-      loader = &PerryASTConsumer::StructCacheLoader;
-      writer = &PerryASTConsumer::StructCacheWriter;
-      break;
+                                   const PerryOutputOptions &Opts)
+  : CI(CI),
+    Visitor(&Context, Results, Loops),
+    Opts(Opts) {
+  if (Opts.TimeSummary) {
+    Timers = std::make_shared<PerryTimers>();
   }
+  if (!Opts.HeaderCacheDir.empty()) {
+    CI.getPreprocessor().addPPCallbacks(
+      std::make_unique<PerryHeaderMacroTracker>(CI.getPreprocessor(),
+                                                HeaderMacros));
+  }
+}
+
+static uint64_t getFileSize(const std::string &Path) {
+  uint64_t Size = 0;
+  llvm::sys::fs::file_size(Path, Size);
+  return Size;
+}
+
+// Take the lock of the file at CacheName and call Update. If WaitBudget (in
+// seconds) is not 0 and the lock cannot be taken before it runs out, call
+// Spill instead, returning what the one called returns. Remarks go to D if
+// given. If Stats is given, how long and how often it waited is recorded there.
+static bool withLockedFile(const std::string &CacheName, DiagnosticsEngine *D,
+                           unsigned WaitBudget, PerryTimers *Timers,
+                           PerryCacheStats *Stats,
+                           llvm::function_ref<bool()> Update,
+                           llvm::function_ref<bool()> Spill) {
+  auto Start = std::chrono::steady_clock::now();
+  auto Deadline = Start + std::chrono::seconds(WaitBudget);
+  // everything up to owning the lock is waiting
+  auto Wait = std::make_unique<PerryPhase>(
+    "PerryLockWait", CacheName, Timers ? &Timers->LockWait : nullptr);
+  auto StopWaiting = [&]() {
+    Wait.reset();
+    if (Stats) {
+      Stats->LockWaitMs = std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - Start).count();
+    }
+  };
   while (true) {
     llvm::LockFileManager Locked(CacheName);
     switch (Locked) {
       case llvm::LockFileManager::LFS_Error: {
-        D.Report(diag::remark_module_lock_failure)
-          << "Failed to acquire lock for" << CacheName;
+        if (D) {
+          D->Report(diag::remark_module_lock_failure)
+            << "Failed to acquire lock for" << CacheName;
+        }
         Locked.unsafeRemoveLockFile();
         LLVM_FALLTHROUGH;
       }
       case llvm::LockFileManager::LFS_Owned: {
-        // we own the lock
-        loader(this);
-        writer(this);
-        return;
+        StopWaiting();
+        return Update();
       }
       case llvm::LockFileManager::LFS_Shared: {
-        // others own the lock, wait
-        switch (Locked.waitForUnlock()) {
+        // others own the lock, wait as long as the budget allows
+        if (Stats) {
+          ++Stats->Retries;
+        }
+        unsigned MaxSeconds = 90;
+        if (WaitBudget) {
+          auto Left = std::chrono::ceil<std::chrono::seconds>(
+            Deadline - std::chrono::steady_clock::now());
+          if (Left.count() <= 0) {
+            if (D) {
+              D->Report(diag::remark_module_lock_timeout)
+                << "Spilling records, timeout when wait for " << CacheName;
+            }
+            StopWaiting();
+            PerryPhase Phase("PerryWrite", CacheName,
+                             Timers ? &Timers->Write : nullptr);
+            bool Spilled = Spill();
+            if (Stats) {
+              Stats->Spilled = true;
+            }
+            return Spilled;
+          }
+          MaxSeconds = std::min<unsigned>(MaxSeconds, Left.count());
+        }
+        switch (Locked.waitForUnlock(MaxSeconds)) {
           case llvm::LockFileManager::Res_Success: {
             // try again
             continue;
@@ -377,8 +366,13 @@ void PerryASTConsumer::updateCache(CacheType ty) {
           }
           case llvm::LockFileManager::Res_Timeout: {
             // try again
-            D.Report(diag::remark_module_lock_timeout)
-              << "Timeout when wait for " << CacheName << "to unlock";
+            if (Stats) {
+              ++Stats->Timeouts;
+            }
+            if (!WaitBudget && D) {
+              D->Report(diag::remark_module_lock_timeout)
+                << "Timeout when wait for " << CacheName << "to unlock";
+            }
             // Locked.unsafeRemoveLockFile();
             continue;
           }
@@ -389,212 +383,982 @@ void PerryASTConsumer::updateCache(CacheType ty) {
   }
 }
 
-void PerryASTConsumer::SuccRetCacheLoader() {
-  if (llvm::sys::fs::exists(outFileSuccRet)) {
-    auto Result = llvm::MemoryBuffer::getFile(outFileSuccRet);
-    if (bool(Result)) {
-      std::vector<PerryFuncRetItem> ReadItem;
-      llvm::yaml::Input yin(Result->get()->getMemBufferRef());
-      yin >> ReadItem;
-
-      if (bool(yin.error())) {
-        llvm::errs() << "Failed to read data from "
-                    << outFileSuccRet
-                    << "\n";
-      } else {
-        for (auto &RI : ReadItem) {
-          SuccRetValMap.insert(std::make_pair(RI.FuncName, RI.SuccVal));
+// Update the file at CacheName with R under a lock: union what is already
+// there into R, then write R back. If the lock cannot be taken in time, R goes
+// to a spill file instead, see withLockedFile. If Stats is given, what the
+// update cost is recorded there, counter tells how many records of the file a
+// result set holds. False if neither the file nor a spill file was written.
+static bool updateLockedFile(
+    DiagnosticsEngine *D, const std::string &CacheName,
+    std::function<bool(const std::string &, PerryResults &)> loader,
+    std::function<bool(const std::string &, const PerryResults &)> writer,
+    PerryResults &R, unsigned WaitBudget, PerryTimers *Timers,
+    PerryCacheStats *Stats = nullptr,
+    std::function<size_t(const PerryResults &)> counter = nullptr) {
+  return withLockedFile(CacheName, D, WaitBudget, Timers, Stats, [&]() {
+    // we own the lock, fold in what others spilled
+    std::vector<std::string> Folded;
+    {
+      PerryPhase Phase("PerryLoad", CacheName,
+                       Timers ? &Timers->Load : nullptr);
+      for (auto &Spill : getSpillFiles(CacheName)) {
+        if (loader(Spill, R)) {
+          Folded.push_back(Spill);
+          if (Stats) {
+            Stats->BytesRead += getFileSize(Spill);
+          }
         }
       }
+      if (Stats) {
+        // keep the old content apart to tell what we add to it
+        PerryResults Old;
+        loader(CacheName, Old);
+        Stats->BytesRead += getFileSize(CacheName);
+        R.merge(Old);
+        Stats->RecordsAdded = counter(R) - counter(Old);
+      } else {
+        loader(CacheName, R);
+      }
     }
-  }
+    PerryPhase Phase("PerryWrite", CacheName,
+                     Timers ? &Timers->Write : nullptr);
+    if (!writer(CacheName, R)) {
+      return false;
+    }
+    for (auto &Spill : Folded) {
+      llvm::sys::fs::remove(Spill);
+    }
+    if (Stats) {
+      Stats->BytesWritten = getFileSize(CacheName);
+    }
+    return true;
+  }, [&]() {
+    return SpillWriter(CacheName, writer, R);
+  });
 }
 
-void PerryASTConsumer::ApiCacheLoader() {
-  if (llvm::sys::fs::exists(outFileApi)) {
-    auto Result = llvm::MemoryBuffer::getFile(outFileApi);
-    if (bool(Result)) {
-      std::vector<PerryApiItem> ReadItem;
-      llvm::yaml::Input yin(Result->get()->getMemBufferRef());
-      yin >> ReadItem;
-
-      if (bool(yin.error())) {
-        llvm::errs() << "Failed to read data from "
-                     << outFileApi
-                     << "\n";
-      } else {
-        for (auto &RI : ReadItem) {
-          FuncDec.insert(RI.FuncName);
-          FuncDef.insert(RI.FuncName);
+// Like updateLockedFile, but the records are kept apart by TU in the units
+// file next to CacheName: the units of New replace those of the same TUs, and
+// the file is written from all units. Records in the file that were written
+// some other way since, or before there was a units file, and records spilled
+// next to the file are kept as records of no TU. Without loader and writer,
+// CacheName is a units file itself.
+static bool updateLockedUnits(
+    DiagnosticsEngine *D, const std::string &CacheName,
+    std::function<bool(const std::string &, PerryResults &)> loader,
+    std::function<bool(const std::string &, const PerryResults &)> writer,
+    const PerryUnits &New, unsigned WaitBudget, PerryTimers *Timers,
+    PerryCacheStats *Stats = nullptr,
+    std::function<size_t(const PerryResults &)> counter = nullptr) {
+  std::string UnitsPath = writer ? getUnitsPath(CacheName) : CacheName;
+  return withLockedFile(CacheName, D, WaitBudget, Timers, Stats, [&]() {
+    PerryUnits Units;
+    PerryResults Old;
+    std::vector<std::string> Folded;
+    {
+      PerryPhase Phase("PerryLoad", CacheName,
+                       Timers ? &Timers->Load : nullptr);
+      UnitsLoader(UnitsPath, Units);
+      if (Stats) {
+        Stats->BytesRead += getFileSize(UnitsPath);
+      }
+      // units spilled by others are newer than the units file
+      for (auto &Spill : getSpillFiles(UnitsPath)) {
+        if (UnitsLoader(Spill, Units)) {
+          Folded.push_back(Spill);
+          if (Stats) {
+            Stats->BytesRead += getFileSize(Spill);
+          }
         }
       }
+      if (writer) {
+        PerryResults Found;
+        if (!isUnitsFileCurrent(CacheName)) {
+          loader(CacheName, Found);
+          if (Stats) {
+            Stats->BytesRead += getFileSize(CacheName);
+          }
+        }
+        // spilled by TUs without -provenance
+        for (auto &Spill : getSpillFiles(CacheName)) {
+          if (loader(Spill, Found)) {
+            Folded.push_back(Spill);
+            if (Stats) {
+              Stats->BytesRead += getFileSize(Spill);
+            }
+          }
+        }
+        Units.seed(Found);
+      }
+      // what was spilled counts as there already, this TU only replaces its
+      // own records
+      if (Stats) {
+        Units.combine(Old);
+      }
     }
-  }
+    for (auto &U : New.Units) {
+      Units.replace(U.second);
+    }
+    PerryResults All;
+    if (writer || Stats) {
+      Units.combine(All);
+    }
+    if (Stats) {
+      size_t Before = counter(Old), After = counter(All);
+      if (After >= Before) {
+        Stats->RecordsAdded = After - Before;
+      } else {
+        Stats->RecordsRetracted = Before - After;
+      }
+    }
+    PerryPhase Phase("PerryWrite", CacheName,
+                     Timers ? &Timers->Write : nullptr);
+    // the units file last, see isUnitsFileCurrent
+    if ((writer && !writer(CacheName, All)) ||
+        !UnitsWriter(UnitsPath, Units)) {
+      return false;
+    }
+    for (auto &Spill : Folded) {
+      llvm::sys::fs::remove(Spill);
+    }
+    if (Stats) {
+      Stats->BytesWritten = getFileSize(UnitsPath);
+      if (writer) {
+        Stats->BytesWritten += getFileSize(CacheName);
+      }
+    }
+    return true;
+  }, [&]() {
+    return SpillWriter(UnitsPath, New);
+  });
 }
 
-void PerryASTConsumer::LoopCacheLoader() {
-  if (llvm::sys::fs::exists(outFileLoops)) {
-    auto Result = llvm::MemoryBuffer::getFile(outFileLoops);
-    if (bool(Result)) {
-      std::vector<PerryLoopItem> ReadItem;
-      llvm::yaml::Input yin(Result->get()->getMemBufferRef());
-      yin >> ReadItem;
+// PerryResultsFlush implementation
+PerryResultsFlush::PerryResultsFlush(PerryResults Results,
+                                     const PerryOutputOptions &Opts,
+                                     std::string ShardPath,
+                                     std::shared_ptr<PerryTimers> Timers,
+                                     DiagnosticsEngine *D)
+  : Results(std::move(Results)),
+    Opts(Opts),
+    ShardPath(std::move(ShardPath)),
+    Timers(std::move(Timers)),
+    D(D) {}
 
-      if (bool(yin.error())) {
-        llvm::errs() << "Failed to read data from "
-                     << outFileLoops
-                     << "\n";
-      } else {
-        for (auto &RI : ReadItem) {
-          AllLoops.insert(PerryLoopItem(RI.FilePath,
-                                          RI.beginLine, RI.beginColumn,
-                                          RI.endLine, RI.endColumn));
-        }
-      }
+void PerryResultsFlush::run() {
+  writeResults();
+  if (!Opts.StatsFile.empty()) {
+    writeStats();
+  }
+  if (Timers) {
+    llvm::errs() << "Perry plugin time in " << Results.TU << "\n";
+    Timers->Group.print(llvm::errs(), /*ResetAfterPrint=*/true);
+  }
+}
+
+bool PerryResultsFlush::updateCache(CacheType ty) {
+  std::string CacheName;
+  std::function<bool(const std::string &, PerryResults &)> loader;
+  std::function<bool(const std::string &, const PerryResults &)> writer;
+  std::function<size_t(const PerryResults &)> counter;
+  // what the file holds, to keep units small with Opts.Provenance
+  uint8_t Kinds = 0;
+  bool Loops = false;
+  PerryCacheStats Stat;
+  switch (ty) {
+    case SuccRet:
+      CacheName = Opts.Files.SuccRet;
+      loader = SuccRetCacheLoader;
+      writer = SuccRetCacheWriter;
+      counter = [](const PerryResults &R) { return R.count(PNK_SuccRet); };
+      Kinds = PNK_SuccRet;
+      Stat.Cache = "succ-ret";
+      break;
+    case Api:
+      CacheName = Opts.Files.Api;
+      loader = ApiCacheLoader;
+      writer = ApiCacheWriter;
+      counter = [](const PerryResults &R) { return R.count(PNK_Api); };
+      Kinds = PNK_Api;
+      Stat.Cache = "api";
+      break;
+    case Loop:
+      CacheName = Opts.Files.Loops;
+      loader = LoopCacheLoader;
+      writer = LoopCacheWriter;
+      counter = [](const PerryResults &R) { return R.AllLoops.size(); };
+      Loops = true;
+      Stat.Cache = "loops";
+      break;
+    case StructName:
+      CacheName = Opts.Files.StructNames;
+      loader = StructCacheLoader;
+      writer = StructCacheWriter;
+      counter = [](const PerryResults &R) {
+        return R.count(PNK_StructName);
+      };
+      Kinds = PNK_StructName;
+      Stat.Cache = "periph-struct";
+      break;
+    case Database:
+      CacheName = Opts.DatabaseFile;
+      loader = DatabaseLoader;
+      writer = DatabaseWriter;
+      counter = [](const PerryResults &R) {
+        return R.count(PNK_SuccRet) + R.count(PNK_FuncDec) +
+               R.count(PNK_FuncDef) + R.AllLoops.size() +
+               R.count(PNK_StructName);
+      };
+      Kinds = PNK_SuccRet | PNK_Api | PNK_StructName;
+      Loops = true;
+      Stat.Cache = "db";
+      break;
+  }
+  bool Record = !Opts.StatsFile.empty();
+  bool Ok;
+  if (Opts.Provenance) {
+    // the database is a units file itself
+    if (ty == Database) {
+      loader = nullptr;
+      writer = nullptr;
+    }
+    PerryUnits New;
+    if (Compacted.Units.empty()) {
+      New.replace(Results.select(Kinds, Loops));
     }
+    for (auto &U : Compacted.Units) {
+      New.replace(U.second.select(Kinds, Loops));
+    }
+    Ok = updateLockedUnits(D, CacheName, loader, writer, New,
+                           Opts.LockWaitBudget, Timers.get(),
+                           Record ? &Stat : nullptr, counter);
+  } else {
+    Ok = updateLockedFile(D, CacheName, loader, writer, Results,
+                          Opts.LockWaitBudget, Timers.get(),
+                          Record ? &Stat : nullptr, counter);
+  }
+  if (Record) {
+    Stats.push_back(Stat);
   }
+  return Ok;
 }
 
-void PerryASTConsumer::StructCacheLoader() {
-  if (llvm::sys::fs::exists(outFileStructNames)) {
-    auto Result = llvm::MemoryBuffer::getFile(outFileStructNames);
-    if (bool(Result)) {
-      std::vector<std::string> ReadItem;
-      llvm::yaml::Input yin(Result->get()->getMemBufferRef());
-      yin >> ReadItem;
+void PerryResultsFlush::writeStats() {
+  llvm::json::Array Caches;
+  double LockWaitMs = 0;
+  for (auto &S : Stats) {
+    LockWaitMs += S.LockWaitMs;
+    Caches.push_back(llvm::json::Object{
+      {"cache", S.Cache},
+      {"lock_wait_ms", S.LockWaitMs},
+      {"retries", S.Retries},
+      {"timeouts", S.Timeouts},
+      {"spilled", S.Spilled},
+      {"bytes_read", (int64_t)S.BytesRead},
+      {"bytes_written", (int64_t)S.BytesWritten},
+      {"records_added", (int64_t)S.RecordsAdded},
+      {"records_retracted", (int64_t)S.RecordsRetracted}
+    });
+  }
+  std::string Line;
+  llvm::raw_string_ostream OS(Line);
+  OS << llvm::json::Value(llvm::json::Object{
+    {"tu", Results.TU},
+    {"lock_wait_ms", LockWaitMs},
+    {"caches", std::move(Caches)}
+  }) << "\n";
+  StatsAppend(Opts.StatsFile, OS.str());
+}
 
-      if (bool(yin.error())) {
-        llvm::errs() << "Failed to read data from "
-                     << outFileLoops
-                     << "\n";
-      } else {
-        for (auto &RI : ReadItem) {
-          periphStructNames.insert(RI);
-        }
+void PerryASTConsumer::collectLoops() {
+  auto &SM = CI.getSourceManager();
+  // ids of the canonical paths by presumed file name, ~0u if the path cannot
+  // be resolved. Resolving takes a few syscalls, and all loops come from a
+  // handful of files.
+  llvm::StringMap<uint32_t> FileIds;
+  auto resolve = [&](StringRef FileName) {
+    auto Inserted = FileIds.try_emplace(FileName, ~0u);
+    if (!Inserted.second) {
+      return Inserted.first->second;
+    }
+    llvm::SmallString<128> real_path;
+    if (!getRealPath(FileName, real_path)) {
+      Inserted.first->second = Results.intern(real_path);
+    }
+    return Inserted.first->second;
+  };
+  for (auto &FL : Loops) {
+    auto &Ranges = FL.second;
+    llvm::sort(Ranges);
+    Ranges.erase(std::unique(Ranges.begin(), Ranges.end()), Ranges.end());
+    for (auto &L : Ranges) {
+      // #line directives may move parts of the file elsewhere
+      PresumedLoc BL = SM.getPresumedLoc(SM.getComposedLoc(FL.first, L.first));
+      PresumedLoc EL =
+        SM.getPresumedLoc(SM.getComposedLoc(FL.first, L.second));
+      if (BL.isInvalid() || EL.isInvalid()) {
+        continue;
       }
+      if (StringRef(BL.getFilename()) != EL.getFilename()) {
+        continue;
+      }
+      uint32_t File = resolve(EL.getFilename());
+      if (File == ~0u) {
+        continue;
+      }
+      Results.AllLoops.push_back({File, BL.getLine(), BL.getColumn(),
+                                  EL.getLine(), EL.getColumn()});
     }
   }
+  Results.sortLoops();
 }
 
-void PerryASTConsumer::SuccRetCacheWriter() {
-  std::vector<PerryFuncRetItem> AllItem;
-  for (auto &p : SuccRetValMap) {
-    AllItem.emplace_back(PerryFuncRetItem(p.first, p.second));
+std::string PerryASTConsumer::getTUName() {
+  auto &SM = CI.getSourceManager();
+  const FileEntry *MainFile = SM.getFileEntryForID(SM.getMainFileID());
+  if (!MainFile) {
+    return CI.getFrontendOpts().Inputs.empty()
+      ? std::string()
+      : CI.getFrontendOpts().Inputs[0].getFile().str();
+  }
+  llvm::SmallString<128> real_path;
+  if (getRealPath(MainFile->getName(), real_path)) {
+    return MainFile->getName().str();
   }
-  std::error_code ErrCode;
-  llvm::raw_fd_ostream fout(outFileSuccRet, ErrCode);
-  if (fout.has_error()) {
-    llvm::errs() << "Failed to open "
-                 << outFileSuccRet 
-                 << " for write: "
-                 << ErrCode.message() << "\nData lost\n";
+  return real_path.str().str();
+}
+
+std::error_code
+PerryASTConsumer::getRealPath(StringRef Path,
+                              llvm::SmallVectorImpl<char> &RealPath) {
+  return CI.getFileManager().getVirtualFileSystem().getRealPath(Path,
+                                                                RealPath);
+}
+
+std::string PerryASTConsumer::getShardPath(StringRef Dir) {
+  llvm::SmallString<128> ShardPath = Dir;
+  llvm::sys::path::append(
+    ShardPath, getShardFileName(Results.TU, Results.Output));
+  return ShardPath.str().str();
+}
+
+void PerryResultsFlush::writeShard() {
+  std::error_code err_code = llvm::sys::fs::create_directories(Opts.ShardDir);
+  if (err_code) {
+    llvm::errs() << "Failed to create " << Opts.ShardDir << ": "
+                 << err_code.message() << "\nData lost\n";
     return;
   }
-  llvm::yaml::Output yout(fout);
-  yout << AllItem;
-}
-
-void PerryASTConsumer::ApiCacheWriter() {
-  std::vector<std::string> HalAPI;
-  std::error_code ErrCode;
-  std::set_intersection(FuncDec.begin(), FuncDec.end(),
-                        FuncDef.begin(), FuncDef.end(),
-                        std::inserter(HalAPI, HalAPI.begin()));
-  std::vector<PerryApiItem> OutAPI;
-  for (auto &Name : HalAPI) {
-    OutAPI.emplace_back(PerryApiItem(Name));
-  }
-  llvm::raw_fd_ostream fout(outFileApi, ErrCode);
-  if (fout.has_error()) {
-    llvm::errs() << "Failed to open "
-                 << outFileApi 
-                 << " for write: "
-                 << ErrCode.message() << "\nData lost\n";
+  ShardWriter(ShardPath, Results);
+}
+
+void PerryResultsFlush::appendJournal() {
+  if (!JournalAppend(Opts.JournalFile, Results)) {
     return;
   }
-  llvm::yaml::Output yout(fout);
-  yout << OutAPI;
+  uint64_t JournalSize;
+  if (!Opts.JournalCompactSize ||
+      llvm::sys::fs::file_size(Opts.JournalFile, JournalSize) ||
+      JournalSize < Opts.JournalCompactSize) {
+    return;
+  }
+  // the journal grew too big, fold it into the output files
+  std::string Taken;
+  bool Read = Opts.Provenance
+    ? JournalTake(Opts.JournalFile, Compacted, Taken)
+    : JournalTake(Opts.JournalFile, Results, Taken);
+  if (!Read || Taken.empty()) {
+    // perry-merge picks up whatever was left behind
+    return;
+  }
+  // all four, even if one fails, and leave the journal to perry-merge then
+  bool Ok = updateCache(SuccRet);
+  Ok &= updateCache(Api);
+  Ok &= updateCache(Loop);
+  Ok &= updateCache(StructName);
+  if (Ok) {
+    llvm::sys::fs::remove(Taken);
+  }
 }
 
-void PerryASTConsumer::LoopCacheWriter() {
-  std::vector<PerryLoopItem> HalLoops;
+void PerryASTConsumer::forEachUserFile(
+    llvm::function_ref<void(const FileEntry *, StringRef)> Fn) {
   auto &SM = CI.getSourceManager();
-  for (auto &L : Loops) {
-    auto beginLoc = SourceLocation::getFromRawEncoding(L.first);
-    auto endLoc = SourceLocation::getFromRawEncoding(L.second);
-    if (!beginLoc.isValid() || !endLoc.isValid()) {
+  for (unsigned i = 0, e = SM.local_sloc_entry_size(); i != e; ++i) {
+    const SrcMgr::SLocEntry &Entry = SM.getLocalSLocEntry(i);
+    if (!Entry.isFile()) {
       continue;
     }
-    if (!beginLoc.isFileID() || !endLoc.isFileID()) {
+    const SrcMgr::FileInfo &FI = Entry.getFile();
+    if (FI.getFileCharacteristic() != SrcMgr::C_User) {
       continue;
     }
-    PresumedLoc BL = SM.getPresumedLoc(beginLoc);
-    PresumedLoc EL = SM.getPresumedLoc(endLoc);
-    if (BL.isInvalid() || EL.isInvalid()) {
+    auto Buffer = FI.getContentCache().getBufferOrNone(
+      SM.getDiagnostics(), SM.getFileManager());
+    if (!Buffer) {
       continue;
     }
-    if (BL.getFilename() != EL.getFilename()) {
+    Fn(FI.getContentCache().OrigEntry, Buffer->getBuffer());
+  }
+}
+
+std::string PerryASTConsumer::getFingerprint() {
+  // every file entered while preprocessing, including the predefines buffer
+  // holding macros from the command line
+  std::string Hashes;
+  llvm::raw_string_ostream OS(Hashes);
+  forEachUserFile([&](const FileEntry *, StringRef Buffer) {
+    OS << llvm::format_hex_no_prefix(llvm::xxHash64(Buffer), 16);
+  });
+  OS << Results.TU;
+  // and the options that change which records are collected, the scope paths
+  // are canonical already. Bump the tag when the records themselves change
+  OS << '\0' << "perry-records-1" << '\0' << Opts.ScopeSkipSystem
+     << !Opts.HeaderCacheDir.empty();
+  for (auto &Path : Opts.ScopeAllow) {
+    OS << '\0' << '+' << Path;
+  }
+  for (auto &Path : Opts.ScopeDeny) {
+    OS << '\0' << '-' << Path;
+  }
+  return llvm::utohexstr(llvm::xxHash64(OS.str()));
+}
+
+std::string
+PerryASTConsumer::getHeaderSummaryPath(const std::string &RealPath,
+                                       const std::string &Key) {
+  llvm::SmallString<128> Path = StringRef(Opts.HeaderCacheDir);
+  llvm::sys::path::append(Path, getShardFileName(RealPath, Key));
+  return Path.str().str();
+}
+
+// decls the traversal starts from, looking through extern "C" blocks
+static void collectScopeDecls(DeclContext *DC, std::vector<Decl *> &Decls) {
+  for (Decl *D : DC->decls()) {
+    if (auto *LSD = dyn_cast<LinkageSpecDecl>(D)) {
+      collectScopeDecls(LSD, Decls);
+    } else {
+      Decls.push_back(D);
+    }
+  }
+}
+
+void PerryASTConsumer::loadHeaderSummaries() {
+  auto &SM = CI.getSourceManager();
+  const FileEntry *MainFile = SM.getFileEntryForID(SM.getMainFileID());
+  // what a header declares may depend on macros from the command line, and
+  // on the macros from elsewhere it uses
+  uint64_t PredefinesHash = 0;
+  std::vector<std::pair<const FileEntry *, uint64_t>> Headers;
+  forEachUserFile([&](const FileEntry *FE, StringRef Buffer) {
+    if (!FE) {
+      PredefinesHash = llvm::xxHash64(Buffer);
+    } else if (FE != MainFile) {
+      Headers.push_back(std::make_pair(FE, llvm::xxHash64(Buffer)));
+    }
+  });
+
+  for (auto &H : Headers) {
+    if (MemoizedHeaders.count(H.first) || HeaderKeys.count(H.first)) {
+      // entered more than once
       continue;
     }
-    llvm::SmallString<128> abs_path = StringRef(EL.getFilename());
-    std::error_code err_code = llvm::sys::fs::make_absolute(abs_path);
-    if (err_code) {
+    if (!isFileInScope(H.first)) {
       continue;
     }
     llvm::SmallString<128> real_path;
-    err_code = llvm::sys::fs::real_path(abs_path, real_path, true);
-    if (err_code) {
+    if (getRealPath(H.first->getName(), real_path)) {
       continue;
     }
-    AllLoops.insert(PerryLoopItem(real_path.str().str(),
-                                     BL.getLine(), BL.getColumn(),
-                                     EL.getLine(), EL.getColumn()));
+    std::vector<uint64_t> Macros;
+    auto Deps = HeaderMacros.find(H.first);
+    if (Deps != HeaderMacros.end()) {
+      Macros.assign(Deps->second.begin(), Deps->second.end());
+    }
+    uint64_t MacrosHash = llvm::xxHash64(
+      StringRef(reinterpret_cast<const char *>(Macros.data()),
+                Macros.size() * sizeof(uint64_t)));
+    std::string Key = llvm::utohexstr(H.second) + "-" +
+                      llvm::utohexstr(PredefinesHash) + "-" +
+                      llvm::utohexstr(MacrosHash);
+    std::string SummaryPath = getHeaderSummaryPath(real_path.str().str(), Key);
+    PerryResults Summary;
+    if (llvm::sys::fs::exists(SummaryPath) &&
+        ShardLoader(SummaryPath, Summary) && Summary.Fingerprint == Key) {
+      Results.merge(Summary);
+      MemoizedHeaders.insert(H.first);
+    } else {
+      HeaderKeys[H.first] = Key;
+    }
+  }
+}
+
+bool PerryASTConsumer::isInScope(Decl *D) {
+  auto &SM = CI.getSourceManager();
+  SourceLocation Loc = SM.getExpansionLoc(D->getLocation());
+  if (Loc.isInvalid()) {
+    return true;
+  }
+  const FileEntry *FE = SM.getFileEntryForID(SM.getFileID(Loc));
+  if (isa<FunctionDecl>(D) && MemoizedHeaders.count(FE)) {
+    return false;
+  }
+  if (Opts.ScopeSkipSystem && SM.isInSystemHeader(Loc)) {
+    return false;
+  }
+  return !FE || isFileInScope(FE);
+}
+
+// whether Path is Dir or in it, /sdk/hal_legacy is not under /sdk/hal
+static bool isUnderPath(StringRef Path, StringRef Dir) {
+  if (!Path.startswith(Dir)) {
+    return false;
+  }
+  return Path.size() == Dir.size() ||
+         llvm::sys::path::is_separator(Dir.back()) ||
+         llvm::sys::path::is_separator(Path[Dir.size()]);
+}
+
+void canonicalizeScopePaths(PerryOutputOptions &Opts) {
+  for (auto *Paths : {&Opts.ScopeAllow, &Opts.ScopeDeny}) {
+    for (auto &Dir : *Paths) {
+      llvm::SmallString<128> real_path;
+      if (llvm::sys::fs::real_path(Dir, real_path, true)) {
+        // not there (yet), still compare it in the same form
+        real_path = Dir;
+        llvm::sys::fs::make_absolute(real_path);
+        llvm::sys::path::remove_dots(real_path, true);
+      }
+      Dir = real_path.str().str();
+    }
+  }
+}
+
+bool PerryASTConsumer::isFileInScope(const FileEntry *FE) {
+  if (Opts.ScopeAllow.empty() && Opts.ScopeDeny.empty()) {
+    return true;
+  }
+  auto Cached = FileInScope.find(FE);
+  if (Cached != FileInScope.end()) {
+    return Cached->second;
   }
-  for (auto &PI : AllLoops) {
-    HalLoops.push_back(PI);
+  llvm::SmallString<128> real_path;
+  if (getRealPath(FE->getName(), real_path)) {
+    real_path = FE->getName();
   }
-  std::error_code ErrCode;
-  llvm::raw_fd_ostream fout(outFileLoops, ErrCode);
-  if (fout.has_error()) {
-    llvm::errs() << "Failed to open "
-                 << outFileLoops 
-                 << " for write: "
-                 << ErrCode.message() << "\nData lost\n";
+  StringRef Path = real_path.str();
+  bool InScope = Opts.ScopeAllow.empty();
+  for (auto &Prefix : Opts.ScopeAllow) {
+    if (isUnderPath(Path, Prefix)) {
+      InScope = true;
+      break;
+    }
+  }
+  for (auto &Prefix : Opts.ScopeDeny) {
+    if (isUnderPath(Path, Prefix)) {
+      InScope = false;
+      break;
+    }
+  }
+  FileInScope[FE] = InScope;
+  return InScope;
+}
+
+void PerryASTConsumer::setTraversalScope(ASTContext &Context) {
+  if (MemoizedHeaders.empty() && !Opts.ScopeSkipSystem &&
+      Opts.ScopeAllow.empty() && Opts.ScopeDeny.empty()) {
     return;
   }
-  llvm::yaml::Output yout(fout);
-  yout << HalLoops;
+  std::vector<Decl *> Scope;
+  collectScopeDecls(Context.getTranslationUnitDecl(), Scope);
+  Scope.erase(std::remove_if(Scope.begin(), Scope.end(),
+                             [&](Decl *D) { return !isInScope(D); }),
+              Scope.end());
+  Context.setTraversalScope(Scope);
 }
 
-void PerryASTConsumer::StructCacheWriter() {
-  std::error_code ErrCode;
-  std::vector<std::string> OutStructNames(periphStructNames.begin(),
-                                          periphStructNames.end());
-  llvm::raw_fd_ostream fout(outFileStructNames, ErrCode);
-  if (fout.has_error()) {
-    llvm::errs() << "Failed to open "
-                 << outFileApi 
-                 << " for write: "
-                 << ErrCode.message() << "\nData lost\n";
+void PerryASTConsumer::storeHeaderSummaries(ASTContext &Context) {
+  if (HeaderKeys.empty() ||
+      llvm::sys::fs::create_directories(Opts.HeaderCacheDir)) {
     return;
   }
-  llvm::yaml::Output yout(fout);
-  yout << OutStructNames;
+  auto &SM = CI.getSourceManager();
+  std::map<const FileEntry *, PerryResults> Summaries;
+  llvm::StringMap<PerryResults *> SummaryOfPath;
+  for (auto &HK : HeaderKeys) {
+    llvm::SmallString<128> real_path;
+    if (getRealPath(HK.first->getName(), real_path)) {
+      continue;
+    }
+    PerryResults &Summary = Summaries[HK.first];
+    Summary.TU = real_path.str().str();
+    Summary.Fingerprint = HK.second;
+    SummaryOfPath[Summary.TU] = &Summary;
+  }
+
+  // mirror what PerryVisitor records for functions in non-system headers
+  std::vector<Decl *> Decls;
+  collectScopeDecls(Context.getTranslationUnitDecl(), Decls);
+  for (Decl *D : Decls) {
+    auto *FD = dyn_cast<FunctionDecl>(D);
+    if (!FD || FD->isNoReturn()) {
+      continue;
+    }
+    FileID FID = SM.getFileID(SM.getExpansionLoc(FD->getLocation()));
+    auto It = Summaries.find(SM.getFileEntryForID(FID));
+    if (It == Summaries.end()) {
+      continue;
+    }
+    std::string FuncName = FD->getNameAsString();
+    It->second.addFuncDec(FuncName);
+    uint64_t SuccVal;
+    if (FD->doesThisDeclarationHaveABody() &&
+        Results.getSuccRet(FuncName, SuccVal)) {
+      It->second.addSuccRet(FuncName, SuccVal);
+    }
+  }
+  for (auto &L : Results.AllLoops) {
+    StringRef File = Results.Strings.get(L.File);
+    auto It = SummaryOfPath.find(File);
+    if (It != SummaryOfPath.end()) {
+      // loops come sorted, so the summary stays sorted
+      It->second->addLoop(File, L.beginLine, L.beginColumn, L.endLine,
+                          L.endColumn);
+    }
+  }
+
+  for (auto &S : Summaries) {
+    ShardWriter(getHeaderSummaryPath(S.second.TU, S.second.Fingerprint),
+                S.second);
+  }
 }
 
-void PerryASTConsumer::HandleTranslationUnit(ASTContext &Context) {
-  // run matcher first to collect enums
-  Matcher.matchAST(Context);
-  // then run visitors
-  Visitor.TraverseDecl(Context.getTranslationUnitDecl());
+bool PerryASTConsumer::loadIncremental(const std::string &EntryPath) {
+  PerryResults Cached;
+  if (!llvm::sys::fs::exists(EntryPath) ||
+      !ShardLoader(EntryPath, Cached) ||
+      Cached.Fingerprint != Results.Fingerprint) {
+    return false;
+  }
+  Results.merge(Cached);
+  return true;
+}
+
+void PerryResultsFlush::spillResults() {
+  // spill files are never locked, each one is written by a single TU
+  bool Ok = SpillWriter(Opts.Files.SuccRet, SuccRetCacheWriter, Results);
+  Ok &= SpillWriter(Opts.Files.Api, ApiCacheWriter, Results);
+  Ok &= SpillWriter(Opts.Files.Loops, LoopCacheWriter, Results);
+  Ok &= SpillWriter(Opts.Files.StructNames, StructCacheWriter, Results);
+  if (!Ok) {
+    llvm::errs() << "Failed to spill the records of " << Results.TU
+                 << "\nData lost\n";
+  }
+}
 
+void PerryResultsFlush::writeResults() {
+  if (Opts.Sink) {
+    Opts.Sink(Results);
+    return;
+  }
+  if (!Opts.DaemonSocket.empty()) {
+    if (DaemonSendRecords(Opts.DaemonSocket, Results)) {
+      return;
+    }
+    llvm::errs() << "perry-daemon did not take the records of " << Results.TU
+                 << ", writing them elsewhere\n";
+  }
+  if (!Opts.SharedTableFile.empty()) {
+    if (SharedTableInsert(Opts.SharedTableFile, Results)) {
+      return;
+    }
+    llvm::errs() << "Failed to insert the records of " << Results.TU
+                 << " into the shared table, writing them elsewhere\n";
+  }
   // dump collected data in YAML format
+  if (!Opts.ShardDir.empty()) {
+    writeShard();
+    return;
+  }
+  if (!Opts.DatabaseFile.empty()) {
+    updateCache(Database);
+    return;
+  }
+  if (!Opts.JournalFile.empty()) {
+    appendJournal();
+    return;
+  }
+  // the output files are written later by the daemon, or replaced by a
+  // perry-merge export of the shared table, and both fold in what is spilled
+  // next to them. Part of the records may be in the table already, which
+  // adds nothing to the union
+  if (!Opts.DaemonSocket.empty() || !Opts.SharedTableFile.empty()) {
+    spillResults();
+    return;
+  }
   updateCache(SuccRet);
   updateCache(Api);
   updateCache(Loop);
   updateCache(StructName);
 }
 
+void PerryASTConsumer::HandleTranslationUnit(ASTContext &Context) {
+  Results.TU = getTUName();
+  Results.Output = CI.getFrontendOpts().OutputFile;
+
+  std::string EntryPath;
+  if (!Opts.IncrementalDir.empty()) {
+    EntryPath = getShardPath(Opts.IncrementalDir);
+    Results.Fingerprint = getFingerprint();
+    if (loadIncremental(EntryPath)) {
+      // the outputs may have lost the records since, and merging them again
+      // adds nothing if they did not
+      flush();
+      return;
+    }
+  }
+
+  if (!Opts.HeaderCacheDir.empty()) {
+    loadHeaderSummaries();
+  }
+  setTraversalScope(Context);
+
+  // a single traversal collects everything
+  {
+    PerryPhase Phase("PerryTraverse", Results.TU,
+                     Timers ? &Timers->Traverse : nullptr);
+    Visitor.TraverseDecl(Context.getTranslationUnitDecl());
+  }
+  {
+    PerryPhase Phase("PerryCollectLoops", Results.TU,
+                     Timers ? &Timers->Loops : nullptr);
+    collectLoops();
+  }
+
+  // leave the full AST to whoever comes next
+  Context.setTraversalScope({Context.getTranslationUnitDecl()});
+  if (!Opts.HeaderCacheDir.empty()) {
+    storeHeaderSummaries(Context);
+  }
+
+  if (!EntryPath.empty() &&
+      !llvm::sys::fs::create_directories(Opts.IncrementalDir)) {
+    ShardWriter(EntryPath, Results);
+  }
+
+  flush();
+}
+
+namespace {
+// Threads flushing results with -async-flush. They are joined by
+// perry-flush-join after code generation. Joining any later, while LLVM tears
+// down, is not safe, so records are only flushed on a thread once its
+// consumer exists.
+class PerryFlushThreads {
+public:
+  ~PerryFlushThreads() {
+    // only left if the compiler exited before perry-flush-join ran, e.g. on a
+    // fatal backend error. The LLVM streams may be gone by now
+    for (auto &F : Threads) {
+      if (!F.Done->load()) {
+        std::fprintf(stderr, "The records of %s may not have been written\n"
+                             "Data lost\n", F.TU.c_str());
+      }
+      F.Thread.detach();
+    }
+  }
+
+  // called by the consumer of perry-flush-join, which is created along with
+  // the consumer of perry before the TU is parsed
+  void expectJoin() {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    JoinExpected = true;
+  }
+
+  bool isJoinExpected() {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    return JoinExpected;
+  }
+
+  void start(std::string TU, std::function<void()> Fn) {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    auto Done = std::make_shared<std::atomic<bool>>(false);
+    std::thread Thread([Fn, Done]() {
+      Fn();
+      Done->store(true);
+    });
+    Threads.push_back({std::move(Thread), std::move(TU), std::move(Done)});
+  }
+
+  void join() {
+    std::vector<Flush> Running;
+    {
+      std::lock_guard<std::mutex> Lock(Mutex);
+      Running.swap(Threads);
+      JoinExpected = false;
+    }
+    for (auto &F : Running) {
+      F.Thread.join();
+    }
+  }
+
+private:
+  struct Flush {
+    std::thread Thread;
+    std::string TU;
+    std::shared_ptr<std::atomic<bool>> Done;
+  };
+  std::mutex Mutex;
+  std::vector<Flush> Threads;
+  bool JoinExpected = false;
+};
+
+PerryFlushThreads FlushThreads;
+} // namespace
+
+void PerryASTConsumer::flush() {
+  std::string ShardPath;
+  if (!Opts.ShardDir.empty()) {
+    ShardPath = getShardPath(Opts.ShardDir);
+  }
+  // a sink runs in process and expects the records before the TU ends, and
+  // without perry-flush-join nothing would wait for the thread
+  bool Async = Opts.AsyncFlush && !Opts.Sink && FlushThreads.isJoinExpected();
+  std::string TU = Results.TU;
+  auto Flush = std::make_shared<PerryResultsFlush>(
+    std::move(Results), Opts, std::move(ShardPath), Timers,
+    Async ? nullptr : &CI.getDiagnostics());
+  if (!Async) {
+    Flush->run();
+    return;
+  }
+  FlushThreads.start(std::move(TU), [Flush]() { Flush->run(); });
+}
+
+// PerryHeaderMacroTracker implementation
+PerryHeaderMacroTracker::PerryHeaderMacroTracker(Preprocessor &PP,
+                                                 DepMap &Deps)
+  : PP(PP), Deps(Deps) {}
+
+const FileEntry *PerryHeaderMacroTracker::getHeader(SourceLocation Loc) {
+  if (Loc.isInvalid()) {
+    return nullptr;
+  }
+  auto &SM = PP.getSourceManager();
+  FileID FID = SM.getFileID(SM.getExpansionLoc(Loc));
+  auto Cached = Headers.find(FID);
+  if (Cached != Headers.end()) {
+    return Cached->second;
+  }
+  const FileEntry *FE = nullptr;
+  bool Invalid = false;
+  const SrcMgr::SLocEntry &Entry = SM.getSLocEntry(FID, &Invalid);
+  if (!Invalid && Entry.isFile() && FID != SM.getMainFileID() &&
+      Entry.getFile().getFileCharacteristic() == SrcMgr::C_User) {
+    FE = SM.getFileEntryForID(FID);
+  }
+  Headers[FID] = FE;
+  return FE;
+}
+
+uint64_t
+PerryHeaderMacroTracker::getDefinitionHash(const IdentifierInfo *II,
+                                           const MacroInfo *MI) {
+  if (!MI) {
+    return llvm::xxHash64(II->getName());
+  }
+  auto Cached = DefinitionHashes.find(MI);
+  if (Cached != DefinitionHashes.end()) {
+    return Cached->second;
+  }
+  std::string Def = II->getName().str() + "=";
+  if (MI->isFunctionLike()) {
+    Def += "(";
+    for (auto *Param : MI->params()) {
+      Def += Param->getName().str() + ",";
+    }
+    Def += MI->isVariadic() ? "...)" : ")";
+  }
+  for (auto &Tok : MI->tokens()) {
+    Def += " " + PP.getSpelling(Tok);
+  }
+  uint64_t Hash = llvm::xxHash64(Def);
+  DefinitionHashes[MI] = Hash;
+  return Hash;
+}
+
+void PerryHeaderMacroTracker::record(SourceLocation Loc,
+                                     const IdentifierInfo *II,
+                                     const MacroInfo *MI) {
+  const FileEntry *Header = getHeader(Loc);
+  if (!Header || !II) {
+    return;
+  }
+  // what the header defines itself only depends on its content
+  if (MI && getHeader(MI->getDefinitionLoc()) == Header) {
+    return;
+  }
+  Deps[Header].insert(getDefinitionHash(II, MI));
+}
+
+void PerryHeaderMacroTracker::recordCondition(SourceLocation Loc,
+                                              SourceRange ConditionRange) {
+  if (!getHeader(Loc) || ConditionRange.isInvalid()) {
+    return;
+  }
+  // identifiers that are not macros never show up as expansions, but the
+  // condition still depends on them staying undefined
+  StringRef Text = Lexer::getSourceText(
+    CharSourceRange::getTokenRange(ConditionRange), PP.getSourceManager(),
+    PP.getLangOpts());
+  size_t i = 0;
+  while (i < Text.size()) {
+    if (!llvm::isAlpha(Text[i]) && Text[i] != '_') {
+      ++i;
+      continue;
+    }
+    size_t Begin = i;
+    while (i < Text.size() && (llvm::isAlnum(Text[i]) || Text[i] == '_')) {
+      ++i;
+    }
+    IdentifierInfo *II = PP.getIdentifierInfo(Text.slice(Begin, i));
+    record(Loc, II, PP.getMacroInfo(II));
+  }
+}
+
+void PerryHeaderMacroTracker::MacroExpands(const Token &MacroNameTok,
+                                           const MacroDefinition &MD,
+                                           SourceRange Range,
+                                           const MacroArgs *Args) {
+  record(MacroNameTok.getLocation(), MacroNameTok.getIdentifierInfo(),
+         MD.getMacroInfo());
+}
+
+void PerryHeaderMacroTracker::If(SourceLocation Loc,
+                                 SourceRange ConditionRange,
+                                 ConditionValueKind ConditionValue) {
+  recordCondition(Loc, ConditionRange);
+}
+
+void PerryHeaderMacroTracker::Elif(SourceLocation Loc,
+                                   SourceRange ConditionRange,
+                                   ConditionValueKind ConditionValue,
+                                   SourceLocation IfLoc) {
+  recordCondition(Loc, ConditionRange);
+}
+
+void PerryHeaderMacroTracker::Ifdef(SourceLocation Loc,
+                                    const Token &MacroNameTok,
+                                    const MacroDefinition &MD) {
+  record(Loc, MacroNameTok.getIdentifierInfo(), MD.getMacroInfo());
+}
+
+void PerryHeaderMacroTracker::Ifndef(SourceLocation Loc,
+                                     const Token &MacroNameTok,
+                                     const MacroDefinition &MD) {
+  record(Loc, MacroNameTok.getIdentifierInfo(), MD.getMacroInfo());
+}
+
 // PerryIncludeProcessor implementation
 PerryIncludeProcessor::PerryIncludeProcessor(std::set<std::string> &Inc)
   : Inc(Inc) {}
@@ -617,8 +1381,9 @@ InclusionDirective(SourceLocation HashLoc, const Token &IncludeTok,
 
 // PerryPeriphStructDefProcessor implementation
 PerryPeriphStructDefProcessor::
-PerryPeriphStructDefProcessor(std::set<std::string> &periphStructNames)
-  : periphStructNames(periphStructNames) {}
+PerryPeriphStructDefProcessor(PerryResults &Results,
+                              std::shared_ptr<PerryTimers> Timers)
+  : Results(Results), Timers(std::move(Timers)) {}
 
 void PerryPeriphStructDefProcessor::MacroExpands(const Token &MacroNameTok,
                                                  const MacroDefinition &MD,
@@ -629,6 +1394,15 @@ void PerryPeriphStructDefProcessor::MacroExpands(const Token &MacroNameTok,
   }
 
   auto MI = MD.getMacroInfo();
+  // every definition is classified once, on its first expansion. MacroInfos
+  // live as long as the preprocessor, so a redefinition never reuses one
+  if (!ClassifiedMacros.insert(MI).second) {
+    return;
+  }
+  // only classifying is timed, the clock costs more than the checks above
+  PerryPhase Phase("PerryMacroExpands", StringRef(),
+                   Timers ? &Timers->Macros : nullptr);
+
   if (MI->getNumParams()) {
     return;
   }
@@ -730,7 +1504,7 @@ void PerryPeriphStructDefProcessor::MacroExpands(const Token &MacroNameTok,
     return;
   }
 
-  periphStructNames.insert(struct_name);
+  Results.addStructName(struct_name);
 }
 
 
@@ -750,7 +1524,7 @@ public:
           return false;
         }
         ++i;
-        outFileSuccRet = arg[i];
+        Opts.Files.SuccRet = arg[i];
       } else if (arg[i] == "-out-file-api") {
         if (i + 1 >= num_args) {
           D.Report(D.getCustomDiagID(DiagnosticsEngine::Error,
@@ -758,7 +1532,7 @@ public:
           return false;
         }
         ++i;
-        outFileApi = arg[i];
+        Opts.Files.Api = arg[i];
       } else if (arg[i] == "-out-file-loops") {
         if (i + 1 >= num_args) {
           D.Report(D.getCustomDiagID(DiagnosticsEngine::Error,
@@ -766,7 +1540,7 @@ public:
           return false;
         }
         ++i;
-        outFileLoops = arg[i];
+        Opts.Files.Loops = arg[i];
       } else if (arg[i] == "-out-file-periph-struct") {
         if (i + 1 >= num_args) {
           D.Report(D.getCustomDiagID(DiagnosticsEngine::Error,
@@ -774,26 +1548,139 @@ public:
           return false;
         }
         ++i;
-        outFileStructNames = arg[i];
+        Opts.Files.StructNames = arg[i];
+      } else if (arg[i] == "-out-shard-dir") {
+        if (i + 1 >= num_args) {
+          D.Report(D.getCustomDiagID(DiagnosticsEngine::Error,
+                                     "missing -out-shard-dir argument"));
+          return false;
+        }
+        ++i;
+        Opts.ShardDir = arg[i];
+      } else if (arg[i] == "-out-file-db") {
+        if (i + 1 >= num_args) {
+          D.Report(D.getCustomDiagID(DiagnosticsEngine::Error,
+                                     "missing -out-file-db argument"));
+          return false;
+        }
+        ++i;
+        Opts.DatabaseFile = arg[i];
+      } else if (arg[i] == "-out-file-journal") {
+        if (i + 1 >= num_args) {
+          D.Report(D.getCustomDiagID(DiagnosticsEngine::Error,
+                                     "missing -out-file-journal argument"));
+          return false;
+        }
+        ++i;
+        Opts.JournalFile = arg[i];
+      } else if (arg[i] == "-journal-compact-size") {
+        if (i + 1 >= num_args ||
+            llvm::StringRef(arg[i + 1]).getAsInteger(0,
+                                                     Opts.JournalCompactSize)) {
+          D.Report(D.getCustomDiagID(DiagnosticsEngine::Error,
+                                     "missing -journal-compact-size argument"));
+          return false;
+        }
+        ++i;
+      } else if (arg[i] == "-daemon-socket") {
+        if (i + 1 >= num_args) {
+          D.Report(D.getCustomDiagID(DiagnosticsEngine::Error,
+                                     "missing -daemon-socket argument"));
+          return false;
+        }
+        ++i;
+        Opts.DaemonSocket = arg[i];
+      } else if (arg[i] == "-out-file-shm") {
+        if (i + 1 >= num_args) {
+          D.Report(D.getCustomDiagID(DiagnosticsEngine::Error,
+                                     "missing -out-file-shm argument"));
+          return false;
+        }
+        ++i;
+        Opts.SharedTableFile = arg[i];
+      } else if (arg[i] == "-stats-file") {
+        if (i + 1 >= num_args) {
+          D.Report(D.getCustomDiagID(DiagnosticsEngine::Error,
+                                     "missing -stats-file argument"));
+          return false;
+        }
+        ++i;
+        Opts.StatsFile = arg[i];
+      } else if (arg[i] == "-time-summary") {
+        Opts.TimeSummary = true;
+      } else if (arg[i] == "-async-flush") {
+        Opts.AsyncFlush = true;
+      } else if (arg[i] == "-provenance") {
+        Opts.Provenance = true;
+      } else if (arg[i] == "-lock-wait-budget") {
+        if (i + 1 >= num_args ||
+            llvm::StringRef(arg[i + 1]).getAsInteger(0,
+                                                     Opts.LockWaitBudget)) {
+          D.Report(D.getCustomDiagID(DiagnosticsEngine::Error,
+                                     "missing -lock-wait-budget argument"));
+          return false;
+        }
+        ++i;
+      } else if (arg[i] == "-incremental-cache-dir") {
+        if (i + 1 >= num_args) {
+          D.Report(D.getCustomDiagID(DiagnosticsEngine::Error,
+                                     "missing -incremental-cache-dir argument"));
+          return false;
+        }
+        ++i;
+        Opts.IncrementalDir = arg[i];
+      } else if (arg[i] == "-header-cache-dir") {
+        if (i + 1 >= num_args) {
+          D.Report(D.getCustomDiagID(DiagnosticsEngine::Error,
+                                     "missing -header-cache-dir argument"));
+          return false;
+        }
+        ++i;
+        Opts.HeaderCacheDir = arg[i];
+      } else if (arg[i] == "-scope-skip-system") {
+        Opts.ScopeSkipSystem = true;
+      } else if (arg[i] == "-scope-allow") {
+        if (i + 1 >= num_args) {
+          D.Report(D.getCustomDiagID(DiagnosticsEngine::Error,
+                                     "missing -scope-allow argument"));
+          return false;
+        }
+        ++i;
+        Opts.ScopeAllow.push_back(arg[i]);
+      } else if (arg[i] == "-scope-deny") {
+        if (i + 1 >= num_args) {
+          D.Report(D.getCustomDiagID(DiagnosticsEngine::Error,
+                                     "missing -scope-deny argument"));
+          return false;
+        }
+        ++i;
+        Opts.ScopeDeny.push_back(arg[i]);
       }
     }
+    canonicalizeScopePaths(Opts);
 
-    if (outFileSuccRet.empty()) {
+    // shards, the database and the journal are exported to the output files
+    // by perry-merge, only compacting the journal needs them here
+    if (!Opts.ShardDir.empty() || !Opts.DatabaseFile.empty() ||
+        (!Opts.JournalFile.empty() && !Opts.JournalCompactSize)) {
+      return true;
+    }
+    if (Opts.Files.SuccRet.empty()) {
       D.Report(D.getCustomDiagID(DiagnosticsEngine::Error,
                                  "missing -out-file-succ-ret argument"));
       return false;
     }
-    if (outFileApi.empty()) {
+    if (Opts.Files.Api.empty()) {
       D.Report(D.getCustomDiagID(DiagnosticsEngine::Error,
                                  "missing -out-file-api argument"));
       return false;
     }
-    if (outFileLoops.empty()) {
+    if (Opts.Files.Loops.empty()) {
       D.Report(D.getCustomDiagID(DiagnosticsEngine::Error,
                                  "missing -out-file-loops argument"));
       return false;
     }
-    if (outFileStructNames.empty()) {
+    if (Opts.Files.StructNames.empty()) {
       D.Report(D.getCustomDiagID(DiagnosticsEngine::Error,
                                  "missing -out-file-periph-struct argument"));
       return false;
@@ -805,26 +1692,128 @@ public:
   CreateASTConsumer(CompilerInstance &CI, llvm::StringRef InFile) override {
     // CI.getPreprocessor().addPPCallbacks(
     //   std::make_unique<PerryIncludeProcessor>(Inc));
-    auto ret = std::make_unique<PerryASTConsumer>(
-        CI.getASTContext(), CI, outFileSuccRet, outFileApi,
-        outFileLoops, outFileStructNames);
+    auto ret = std::make_unique<PerryASTConsumer>(CI.getASTContext(), CI, Opts);
     CI.getPreprocessor().addPPCallbacks(
-      std::make_unique<PerryPeriphStructDefProcessor>(ret->getStructNames()));
+      std::make_unique<PerryPeriphStructDefProcessor>(ret->getResults(),
+                                                      ret->getTimers()));
     return ret;
       
   }
 
+  // only with -add-plugin perry, so that loading the library for another of
+  // its actions does not require the arguments of this one
   ActionType getActionType() override {
-    return AddBeforeMainAction;
+    return CmdlineBeforeMainAction;
   }
 
 private:
-  std::string outFileSuccRet;
-  std::string outFileApi;
-  std::string outFileLoops;
-  std::string outFileStructNames;
+  PerryOutputOptions Opts;
 };
 
 // register FrontendAction
 static FrontendPluginRegistry::Add<PerryPluginAction>
-  X("perry", "Perry clang plugin");
\ No newline at end of file
+  X("perry", "Perry clang plugin");
+
+// Consumer that waits for the results flushed with -async-flush
+class PerryFlushJoinConsumer : public ASTConsumer {
+public:
+  PerryFlushJoinConsumer() {
+    FlushThreads.expectJoin();
+  }
+  void HandleTranslationUnit(ASTContext &Context) override {
+    FlushThreads.join();
+  }
+};
+
+// FrontendAction that runs after the main action, so that flushing overlaps
+// with code generation but is done before the compiler tears down
+class PerryFlushJoinAction : public PluginASTAction {
+public:
+  bool ParseArgs(const CompilerInstance &CI,
+                 const std::vector<std::string> &arg) override {
+    return true;
+  }
+  std::unique_ptr<ASTConsumer>
+  CreateASTConsumer(CompilerInstance &CI, llvm::StringRef InFile) override {
+    return std::make_unique<PerryFlushJoinConsumer>();
+  }
+  ActionType getActionType() override {
+    return AddAfterMainAction;
+  }
+};
+
+static FrontendPluginRegistry::Add<PerryFlushJoinAction>
+  Z("perry-flush-join", "Wait for the results of the Perry clang plugin");
+
+// FrontendAction that only runs the preprocessor to collect peripheral structs,
+// which are found from macro tokens alone
+class PerryPeriphStructAction : public PluginASTAction {
+public:
+  bool ParseArgs(const CompilerInstance &CI,
+                 const std::vector<std::string> &arg) override {
+    DiagnosticsEngine &D = CI.getDiagnostics();
+    auto num_args = arg.size();
+    for (size_t i = 0; i < num_args; ++i) {
+      if (arg[i] == "-out-file-periph-struct") {
+        if (i + 1 >= num_args) {
+          D.Report(D.getCustomDiagID(DiagnosticsEngine::Error,
+                                     "missing -out-file-periph-struct argument"));
+          return false;
+        }
+        ++i;
+        OutFile = arg[i];
+      } else if (arg[i] == "-lock-wait-budget") {
+        if (i + 1 >= num_args ||
+            llvm::StringRef(arg[i + 1]).getAsInteger(0, LockWaitBudget)) {
+          D.Report(D.getCustomDiagID(DiagnosticsEngine::Error,
+                                     "missing -lock-wait-budget argument"));
+          return false;
+        }
+        ++i;
+      }
+    }
+    if (OutFile.empty()) {
+      D.Report(D.getCustomDiagID(DiagnosticsEngine::Error,
+                                 "missing -out-file-periph-struct argument"));
+      return false;
+    }
+    return true;
+  }
+  std::unique_ptr<ASTConsumer>
+  CreateASTConsumer(CompilerInstance &CI, llvm::StringRef InFile) override {
+    // never called, there is no AST
+    return std::make_unique<ASTConsumer>();
+  }
+  ActionType getActionType() override {
+    return ReplaceAction;
+  }
+  bool usesPreprocessorOnly() const override {
+    return true;
+  }
+protected:
+  bool BeginSourceFileAction(CompilerInstance &CI) override {
+    CI.getPreprocessor().addPPCallbacks(
+      std::make_unique<PerryPeriphStructDefProcessor>(Results));
+    return true;
+  }
+  void ExecuteAction() override {
+    Preprocessor &PP = getCompilerInstance().getPreprocessor();
+    PP.EnterMainSourceFile();
+    Token Tok;
+    do {
+      PP.Lex(Tok);
+    } while (Tok.isNot(tok::eof));
+  }
+  void EndSourceFileAction() override {
+    updateLockedFile(&getCompilerInstance().getDiagnostics(), OutFile,
+                     StructCacheLoader, StructCacheWriter, Results,
+                     LockWaitBudget, nullptr);
+  }
+private:
+  std::string OutFile;
+  unsigned LockWaitBudget = 0;
+  PerryResults Results;
+};
+// register FrontendAction
+static FrontendPluginRegistry::Add<PerryPeriphStructAction>
+  Y("perry-periph-struct", "Perry peripheral struct scan");
@@ -0,0 +1,84 @@
+#include "PerryDaemon.h"
+
+#include "llvm/ADT/Twine.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+bool DaemonReadAll(int FD, std::string &Buffer) {
+  char Chunk[4096];
+  while (true) {
+    ssize_t Read = ::read(FD, Chunk, sizeof(Chunk));
+    if (Read < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    if (Read == 0) {
+      return true;
+    }
+    Buffer.append(Chunk, Read);
+  }
+}
+
+bool DaemonWriteAll(int FD, llvm::StringRef Buffer) {
+  while (!Buffer.empty()) {
+    // never raise SIGPIPE in the compiler if the daemon goes away
+    ssize_t Written = ::send(FD, Buffer.data(), Buffer.size(), MSG_NOSIGNAL);
+    if (Written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    Buffer = Buffer.drop_front(Written);
+  }
+  return true;
+}
+
+static bool sendRequest(const std::string &Socket, llvm::StringRef Request) {
+  struct sockaddr_un Addr;
+  if (Socket.size() >= sizeof(Addr.sun_path)) {
+    llvm::errs() << "Socket path too long: " << Socket << "\n";
+    return false;
+  }
+  std::memset(&Addr, 0, sizeof(Addr));
+  Addr.sun_family = AF_UNIX;
+  std::memcpy(Addr.sun_path, Socket.c_str(), Socket.size());
+
+  int FD = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (FD < 0) {
+    return false;
+  }
+  std::string Reply;
+  bool Ok = !::connect(FD, (struct sockaddr *)&Addr, sizeof(Addr)) &&
+            DaemonWriteAll(FD, Request) &&
+            !::shutdown(FD, SHUT_WR) &&
+            DaemonReadAll(FD, Reply);
+  if (!Ok) {
+    llvm::errs() << "Failed to talk to perry-daemon at " << Socket << ": "
+                 << std::strerror(errno) << "\n";
+  }
+  ::close(FD);
+  if (!Ok) {
+    return false;
+  }
+  return llvm::StringRef(Reply).trim() == PerryDaemonOk;
+}
+
+bool DaemonSendRecords(const std::string &Socket, const PerryResults &R) {
+  std::string Request = PerryDaemonRecords;
+  Request += "\n";
+  Request += ShardToString(R);
+  return sendRequest(Socket, Request);
+}
+
+bool DaemonSendCommand(const std::string &Socket, llvm::StringRef Verb) {
+  return sendRequest(Socket, (llvm::Twine(Verb) + "\n").str());
+}
@@ -0,0 +1,101 @@
+#include "PerryIndex.h"
+#include "PerryResults.h"
+
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Support/FileUtilities.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/raw_ostream.h"
+
+namespace {
+// Lays out the index in memory before it is written in one go
+class PerryIndexBuilder {
+public:
+  PerryIndexString intern(llvm::StringRef S) {
+    auto It = Interned.try_emplace(S, PerryIndexString{0, 0});
+    if (It.second) {
+      It.first->second = {(uint32_t)Strings.size(), (uint32_t)S.size()};
+      Strings.append(S.begin(), S.end());
+    }
+    return It.first->second;
+  }
+
+  template<typename T>
+  void addSection(PerryIndexSectionKind Kind, const std::vector<T> &Records) {
+    addSection(Kind, reinterpret_cast<const char *>(Records.data()),
+               Records.size() * sizeof(T), Records.size());
+  }
+
+  void addStrings() {
+    addSection(PIS_Strings, Strings.data(), Strings.size(), Strings.size());
+  }
+
+  std::string finish() {
+    std::memcpy(Header.Magic, PerryIndexMagic, sizeof(PerryIndexMagic));
+    Header.Version = PerryIndexVersion;
+    Header.ByteOrder = PerryIndexByteOrder;
+    std::memcpy(&Body[0], &Header, sizeof(Header));
+    return std::move(Body);
+  }
+
+private:
+  llvm::StringMap<PerryIndexString> Interned;
+  std::string Strings;
+  PerryIndexHeader Header = {};
+  // room for the header, filled in by finish()
+  std::string Body = std::string(sizeof(PerryIndexHeader), '\0');
+
+  void addSection(PerryIndexSectionKind Kind, const char *Data, size_t Size,
+                  size_t Count) {
+    Body.resize(llvm::alignTo(Body.size(), 8), '\0');
+    Header.Sections[Kind] = {Body.size(), Size, Count};
+    Body.append(Data, Size);
+  }
+};
+} // namespace
+
+bool IndexWriter(const std::string &Path, const PerryResults &R) {
+  PerryIndexBuilder Builder;
+
+  // names and loop files come out ordered, so every section is sorted
+  std::vector<PerryIndexString> Apis;
+  for (auto Id : R.getNames(PNK_Api)) {
+    Apis.push_back(Builder.intern(R.Strings.get(Id)));
+  }
+
+  std::vector<PerryIndexSuccRet> SuccRet;
+  for (auto Id : R.getNames(PNK_SuccRet)) {
+    SuccRet.push_back({Builder.intern(R.Strings.get(Id)), R.Names[Id].SuccVal});
+  }
+
+  std::vector<PerryIndexFile> Files;
+  std::vector<PerryIndexLoop> Loops;
+  R.forEachFileLoops([&](llvm::StringRef File,
+                         llvm::ArrayRef<PerryLoopItem> FileLoops) {
+    Files.push_back({Builder.intern(File), (uint32_t)Loops.size(),
+                     (uint32_t)FileLoops.size()});
+    for (auto &L : FileLoops) {
+      Loops.push_back({L.beginLine, L.beginColumn, L.endLine, L.endColumn});
+    }
+  });
+
+  std::vector<PerryIndexString> Structs;
+  for (auto Id : R.getNames(PNK_StructName)) {
+    Structs.push_back(Builder.intern(R.Strings.get(Id)));
+  }
+
+  Builder.addSection(PIS_Apis, Apis);
+  Builder.addSection(PIS_SuccRet, SuccRet);
+  Builder.addSection(PIS_Files, Files);
+  Builder.addSection(PIS_Loops, Loops);
+  Builder.addSection(PIS_Structs, Structs);
+  Builder.addStrings();
+
+  auto Err = llvm::writeFileAtomically(Path + "-%%%%%%%%.tmp", Path,
+                                       Builder.finish());
+  if (Err) {
+    llvm::errs() << "Failed to write " << Path << ": "
+                 << llvm::toString(std::move(Err)) << "\nData lost\n";
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,1158 @@
+#include "PerryResults.h"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/FileUtilities.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/YAMLParser.h"
+#include "llvm/Support/YAMLTraits.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
+
+#include <algorithm>
+#include <array>
+#include <numeric>
+
+#include <sys/file.h>
+#include <unistd.h>
+
+// PerryStringTable implementation
+PerryStringTable &PerryStringTable::operator=(const PerryStringTable &Other) {
+  if (this != &Other) {
+    Ids.clear();
+    Strings.clear();
+    for (auto S : Other.Strings) {
+      intern(S);
+    }
+  }
+  return *this;
+}
+
+uint32_t PerryStringTable::intern(llvm::StringRef S) {
+  auto Inserted = Ids.try_emplace(S, (uint32_t)Strings.size());
+  if (Inserted.second) {
+    Strings.push_back(Inserted.first->getKey());
+  }
+  return Inserted.first->getValue();
+}
+
+bool PerryStringTable::find(llvm::StringRef S, uint32_t &Id) const {
+  auto It = Ids.find(S);
+  if (It == Ids.end()) {
+    return false;
+  }
+  Id = It->getValue();
+  return true;
+}
+
+// PerryResults implementation
+uint32_t PerryResults::intern(llvm::StringRef S) {
+  uint32_t Id = Strings.intern(S);
+  if (Id >= Names.size()) {
+    Names.resize(Id + 1);
+  }
+  return Id;
+}
+
+void PerryResults::addSuccRet(llvm::StringRef Func, uint64_t SuccVal) {
+  auto &N = Names[intern(Func)];
+  if (!(N.Kinds & PNK_SuccRet)) {
+    N.Kinds |= PNK_SuccRet;
+    N.SuccVal = SuccVal;
+  }
+}
+
+void PerryResults::addName(llvm::StringRef Name, uint8_t Kinds) {
+  Names[intern(Name)].Kinds |= Kinds;
+}
+
+void PerryResults::addLoop(llvm::StringRef File, unsigned beginLine,
+                           unsigned beginColumn, unsigned endLine,
+                           unsigned endColumn) {
+  AllLoops.push_back(
+    {intern(File), beginLine, beginColumn, endLine, endColumn});
+}
+
+void PerryResults::sortLoops() {
+  std::sort(AllLoops.begin(), AllLoops.end());
+  AllLoops.erase(std::unique(AllLoops.begin(), AllLoops.end()),
+                 AllLoops.end());
+}
+
+bool PerryResults::hasSuccRet(llvm::StringRef Func) const {
+  uint64_t SuccVal;
+  return getSuccRet(Func, SuccVal);
+}
+
+bool PerryResults::getSuccRet(llvm::StringRef Func, uint64_t &SuccVal) const {
+  uint32_t Id;
+  if (!Strings.find(Func, Id) || !(Names[Id].Kinds & PNK_SuccRet)) {
+    return false;
+  }
+  SuccVal = Names[Id].SuccVal;
+  return true;
+}
+
+size_t PerryResults::count(uint8_t Kinds) const {
+  return std::count_if(Names.begin(), Names.end(),
+                       [&](const PerryNameRecord &N) {
+                         return (N.Kinds & Kinds) == Kinds;
+                       });
+}
+
+std::vector<uint32_t> PerryResults::getNames(uint8_t Kinds) const {
+  std::vector<uint32_t> Ids;
+  for (uint32_t Id = 0; Id < Names.size(); ++Id) {
+    if ((Names[Id].Kinds & Kinds) == Kinds) {
+      Ids.push_back(Id);
+    }
+  }
+  std::sort(Ids.begin(), Ids.end(), [&](uint32_t A, uint32_t B) {
+    return Strings.get(A) < Strings.get(B);
+  });
+  return Ids;
+}
+
+void PerryResults::forEachFileLoops(
+    llvm::function_ref<void(llvm::StringRef,
+                            llvm::ArrayRef<PerryLoopItem>)> Fn) const {
+  // loops are sorted by file id, so each file is a single run
+  std::vector<std::pair<uint32_t, size_t>> Runs;
+  for (size_t i = 0; i < AllLoops.size(); ++i) {
+    if (!i || AllLoops[i].File != AllLoops[i - 1].File) {
+      Runs.push_back({AllLoops[i].File, i});
+    }
+  }
+  std::vector<size_t> Order(Runs.size());
+  std::iota(Order.begin(), Order.end(), 0);
+  std::sort(Order.begin(), Order.end(), [&](size_t A, size_t B) {
+    return Strings.get(Runs[A].first) < Strings.get(Runs[B].first);
+  });
+  llvm::ArrayRef<PerryLoopItem> Loops(AllLoops);
+  for (size_t i : Order) {
+    size_t End = i + 1 < Runs.size() ? Runs[i + 1].second : AllLoops.size();
+    Fn(Strings.get(Runs[i].first),
+       Loops.slice(Runs[i].second, End - Runs[i].second));
+  }
+}
+
+void PerryResults::merge(const PerryResults &Other, bool SortLoops) {
+  // ids of the strings of Other in this table
+  std::vector<uint32_t> Remap(Other.Names.size());
+  for (uint32_t Id = 0; Id < Other.Names.size(); ++Id) {
+    Remap[Id] = intern(Other.Strings.get(Id));
+    auto &N = Names[Remap[Id]];
+    auto &O = Other.Names[Id];
+    if ((O.Kinds & PNK_SuccRet) && !(N.Kinds & PNK_SuccRet)) {
+      N.SuccVal = O.SuccVal;
+    }
+    N.Kinds |= O.Kinds;
+  }
+  size_t Size = AllLoops.size();
+  for (auto L : Other.AllLoops) {
+    L.File = Remap[L.File];
+    AllLoops.push_back(L);
+  }
+  if (SortLoops && Size != AllLoops.size()) {
+    sortLoops();
+  }
+}
+
+PerryResults PerryResults::select(uint8_t Kinds, bool Loops) const {
+  PerryResults R;
+  R.TU = TU;
+  R.Output = Output;
+  R.Fingerprint = Fingerprint;
+  for (uint32_t Id = 0; Id < Names.size(); ++Id) {
+    uint8_t K = Names[Id].Kinds & Kinds;
+    if (K & PNK_SuccRet) {
+      R.addSuccRet(Strings.get(Id), Names[Id].SuccVal);
+    }
+    if (K & ~PNK_SuccRet) {
+      R.addName(Strings.get(Id), K & ~PNK_SuccRet);
+    }
+  }
+  if (Loops) {
+    for (auto &L : AllLoops) {
+      R.addLoop(Strings.get(L.File), L.beginLine, L.beginColumn, L.endLine,
+                L.endColumn);
+    }
+    R.sortLoops();
+  }
+  return R;
+}
+
+// PerryUnits implementation
+void PerryUnits::replace(PerryResults R) {
+  if (R.TU.empty()) {
+    // nothing to replace, records of no TU only add up
+    Units[R.TU].merge(R);
+    return;
+  }
+  std::string Key = (R.TU + llvm::Twine('\0') + R.Output).str();
+  Units[Key] = std::move(R);
+}
+
+void PerryUnits::seed(const PerryResults &Found) {
+  PerryResults Held;
+  combine(Held);
+  PerryResults Unknown;
+  for (uint32_t Id = 0; Id < Found.Names.size(); ++Id) {
+    llvm::StringRef Name = Found.Strings.get(Id);
+    uint8_t Kinds = Found.Names[Id].Kinds;
+    uint32_t HeldId;
+    if (Held.Strings.find(Name, HeldId) && HeldId < Held.Names.size()) {
+      Kinds &= ~Held.Names[HeldId].Kinds;
+    }
+    if (Kinds & PNK_SuccRet) {
+      Unknown.addSuccRet(Name, Found.Names[Id].SuccVal);
+    }
+    if (Kinds & ~PNK_SuccRet) {
+      Unknown.addName(Name, Kinds & ~PNK_SuccRet);
+    }
+  }
+  for (auto &L : Found.AllLoops) {
+    llvm::StringRef File = Found.Strings.get(L.File);
+    PerryLoopItem H = L;
+    if (Held.Strings.find(File, H.File) &&
+        std::binary_search(Held.AllLoops.begin(), Held.AllLoops.end(), H)) {
+      continue;
+    }
+    Unknown.addLoop(File, L.beginLine, L.beginColumn, L.endLine,
+                    L.endColumn);
+  }
+  if (Unknown.Names.empty() && Unknown.AllLoops.empty()) {
+    return;
+  }
+  Unknown.sortLoops();
+  replace(std::move(Unknown));
+}
+
+void PerryUnits::combine(PerryResults &R) const {
+  for (auto &U : Units) {
+    R.merge(U.second, /*SortLoops=*/false);
+  }
+  R.sortLoops();
+}
+
+// YAML I/O
+struct PerryFuncRetItem {
+  std::string FuncName;
+  uint64_t SuccVal;
+  PerryFuncRetItem(const std::string &FuncName, uint64_t SuccVal)
+    : FuncName(FuncName), SuccVal(SuccVal) {}
+  PerryFuncRetItem() = default;
+};
+
+struct PerryApiItem {
+  std::string FuncName;
+  PerryApiItem(const std::string &FuncName) : FuncName(FuncName) {}
+  PerryApiItem() = default;
+};
+
+struct PerryLoopFileItem {
+  std::string FilePath;
+  unsigned beginLine = 0;
+  unsigned beginColumn = 0;
+  unsigned endLine = 0;
+  unsigned endColumn = 0;
+};
+
+struct PerryShardItem {
+  std::string TU;
+  std::string Output;
+  std::string Fingerprint;
+  std::vector<PerryFuncRetItem> SuccRet;
+  std::vector<std::string> FuncDec;
+  std::vector<std::string> FuncDef;
+  std::vector<PerryLoopFileItem> Loops;
+  std::vector<std::string> StructNames;
+};
+
+template<>
+struct llvm::yaml::MappingTraits<PerryFuncRetItem> {
+  static void mapping(IO &io, PerryFuncRetItem &item) {
+    io.mapRequired("func", item.FuncName);
+    io.mapRequired("succ_val", item.SuccVal);
+  }
+};
+
+template<>
+struct llvm::yaml::MappingTraits<PerryApiItem> {
+  static void mapping(IO &io, PerryApiItem &item) {
+    io.mapRequired("api", item.FuncName);
+  }
+};
+
+template<>
+struct llvm::yaml::MappingTraits<PerryLoopFileItem> {
+  static void mapping(IO &io, PerryLoopFileItem &item) {
+    io.mapRequired("file", item.FilePath);
+    io.mapRequired("begin_line", item.beginLine);
+    io.mapRequired("begin_column", item.beginColumn);
+    io.mapRequired("end_line", item.endLine);
+    io.mapRequired("end_column", item.endColumn);
+  }
+};
+
+LLVM_YAML_IS_SEQUENCE_VECTOR(PerryFuncRetItem)
+LLVM_YAML_IS_SEQUENCE_VECTOR(PerryApiItem)
+LLVM_YAML_IS_SEQUENCE_VECTOR(PerryLoopFileItem)
+
+template<>
+struct llvm::yaml::MappingTraits<PerryShardItem> {
+  static void mapping(IO &io, PerryShardItem &item) {
+    io.mapOptional("tu", item.TU, std::string());
+    io.mapOptional("output", item.Output, std::string());
+    io.mapOptional("fingerprint", item.Fingerprint, std::string());
+    io.mapOptional("succ_ret", item.SuccRet);
+    io.mapOptional("func_dec", item.FuncDec);
+    io.mapOptional("func_def", item.FuncDef);
+    io.mapOptional("loops", item.Loops);
+    io.mapOptional("periph_structs", item.StructNames);
+  }
+};
+
+// read Path into Buffer, a missing file is not an error and leaves Buffer null
+static bool readFile(const std::string &Path,
+                     std::unique_ptr<llvm::MemoryBuffer> &Buffer) {
+  if (!llvm::sys::fs::exists(Path)) {
+    return true;
+  }
+  auto Result = llvm::MemoryBuffer::getFile(Path);
+  if (!bool(Result)) {
+    llvm::errs() << "Failed to open " << Path << " for read: "
+                 << Result.getError().message() << "\n";
+    return false;
+  }
+  Buffer = std::move(*Result);
+  return true;
+}
+
+// parse Buffer read from Path into Items
+template<typename T>
+static bool parseYAMLFile(const std::string &Path,
+                          const llvm::MemoryBuffer &Buffer, T &Items) {
+  llvm::yaml::Input yin(Buffer.getMemBufferRef());
+  yin >> Items;
+  if (bool(yin.error())) {
+    llvm::errs() << "Failed to read data from " << Path << "\n";
+    return false;
+  }
+  return true;
+}
+
+// read Path into Items, a missing file is not an error
+template<typename T>
+static bool readYAMLFile(const std::string &Path, T &Items) {
+  std::unique_ptr<llvm::MemoryBuffer> Buffer;
+  if (!readFile(Path, Buffer)) {
+    return false;
+  }
+  return !Buffer || parseYAMLFile(Path, *Buffer, Items);
+}
+
+namespace {
+// Reads the output files the way the writers lay them out: a single document
+// holding a block sequence of scalars or of flat mappings, with one scalar or
+// field per line. It allocates nothing and gives up on anything else, leaving
+// the file to yaml::Input.
+class PerryFastYAMLReader {
+public:
+  // fields of a mapping, or the scalar of a sequence of scalars with an empty
+  // key
+  class Item {
+  public:
+    size_t size() const { return Size; }
+    bool get(llvm::StringRef Key, llvm::StringRef &Value) const {
+      for (size_t i = 0; i < Size; ++i) {
+        if (Fields[i].Key == Key) {
+          Value = Fields[i].Value;
+          return true;
+        }
+      }
+      return false;
+    }
+    template<typename T>
+    bool getInteger(llvm::StringRef Key, T &Value) const {
+      llvm::StringRef Scalar;
+      // same radix detection as yaml::Input
+      return get(Key, Scalar) && !Scalar.getAsInteger(0, Value);
+    }
+
+  private:
+    friend class PerryFastYAMLReader;
+    struct Field {
+      llvm::StringRef Key;
+      llvm::StringRef Value;
+      // unescaped single-quoted scalar
+      std::string Storage;
+    };
+    // the mappings written have at most five fields
+    std::array<Field, 8> Fields;
+    size_t Size = 0;
+  };
+
+  explicit PerryFastYAMLReader(llvm::StringRef Buffer) : Buffer(Buffer) {}
+
+  // call Fn for every item. Returns false if the buffer is not laid out as
+  // expected or Fn returns false, Fn may have been called for some items then.
+  bool read(bool Mappings, llvm::function_ref<bool(const Item &)> Fn);
+
+private:
+  llvm::StringRef Buffer;
+
+  llvm::StringRef nextLine() {
+    auto Split = Buffer.split('\n');
+    Buffer = Split.second;
+    return Split.first.rtrim('\r');
+  }
+  static bool parseScalar(llvm::StringRef Scalar, std::string &Storage,
+                          llvm::StringRef &Value);
+  static bool parseField(llvm::StringRef Line, Item &I);
+};
+} // namespace
+
+bool PerryFastYAMLReader::parseScalar(llvm::StringRef Scalar,
+                                      std::string &Storage,
+                                      llvm::StringRef &Value) {
+  if (Scalar.empty()) {
+    return false;
+  }
+  if (Scalar.front() == '\'') {
+    if (Scalar.size() < 2 || Scalar.back() != '\'') {
+      return false;
+    }
+    Value = Scalar.drop_front().drop_back();
+    if (Value.contains('\'')) {
+      // quotes are doubled
+      Storage.clear();
+      for (size_t i = 0; i < Value.size(); ++i) {
+        if (Value[i] == '\'' && (i + 1 == Value.size() || Value[++i] != '\'')) {
+          return false;
+        }
+        Storage.push_back(Value[i]);
+      }
+      Value = Storage;
+    }
+    return true;
+  }
+  if (Scalar.front() == '"') {
+    // escapes are left to yaml::Input
+    if (Scalar.size() < 2 || Scalar.back() != '"') {
+      return false;
+    }
+    Value = Scalar.drop_front().drop_back();
+    return !Value.contains('"') && !Value.contains('\\');
+  }
+  // a plain scalar, unless it starts with an indicator or holds a mapping,
+  // a comment, or a sequence
+  if (llvm::StringRef("-?:,[]{}#&*!|>'\"%@`").contains(Scalar.front()) ||
+      Scalar.contains(": ") || Scalar.contains(" #") ||
+      Scalar.back() == ':' || Scalar.back() == ' ') {
+    return false;
+  }
+  Value = Scalar;
+  return true;
+}
+
+bool PerryFastYAMLReader::parseField(llvm::StringRef Line, Item &I) {
+  if (I.Size == I.Fields.size()) {
+    return false;
+  }
+  auto &F = I.Fields[I.Size];
+  size_t Colon = Line.find(':');
+  if (Colon == llvm::StringRef::npos || Colon + 1 == Line.size() ||
+      Line[Colon + 1] != ' ') {
+    return false;
+  }
+  F.Key = Line.take_front(Colon);
+  if (F.Key.empty() ||
+      F.Key.find_if_not([](char C) {
+        return llvm::isAlnum(C) || C == '_';
+      }) != llvm::StringRef::npos) {
+    return false;
+  }
+  if (!parseScalar(Line.drop_front(Colon + 1).ltrim(' '), F.Storage,
+                   F.Value)) {
+    return false;
+  }
+  ++I.Size;
+  return true;
+}
+
+bool PerryFastYAMLReader::read(bool Mappings,
+                               llvm::function_ref<bool(const Item &)> Fn) {
+  llvm::StringRef Line = nextLine();
+  if (Line == "--- []") {
+    Line = "[]";
+  } else if (Line != "---") {
+    return false;
+  } else {
+    Line = nextLine();
+  }
+  if (Line == "[]") {
+    Line = nextLine();
+    return (Line == "..." || Line.empty()) && Buffer.trim().empty();
+  }
+  Item I;
+  bool InItem = false;
+  for (;; Line = nextLine()) {
+    if (Line.startswith("- ")) {
+      if (InItem && !Fn(I)) {
+        return false;
+      }
+      I.Size = 0;
+      InItem = true;
+      if (Mappings) {
+        if (!parseField(Line.drop_front(2), I)) {
+          return false;
+        }
+      } else {
+        auto &F = I.Fields[0];
+        F.Key = llvm::StringRef();
+        if (!parseScalar(Line.drop_front(2), F.Storage, F.Value)) {
+          return false;
+        }
+        I.Size = 1;
+      }
+    } else if (Mappings && InItem && Line.startswith("  ") &&
+               !Line.startswith("   ")) {
+      if (!parseField(Line.drop_front(2), I)) {
+        return false;
+      }
+    } else if ((Line == "..." || Line.empty()) && Buffer.trim().empty()) {
+      // another document or trailing garbage is left to yaml::Input
+      return InItem && Fn(I);
+    } else {
+      return false;
+    }
+  }
+}
+
+// replace Path with what Write writes. The content goes to a temporary file
+// that is renamed over Path, so readers see either the old or the new file in
+// full and need no lock, and a failed write leaves the old file intact
+static bool writeFile(const std::string &Path,
+                      llvm::function_ref<void(llvm::raw_ostream &)> Write) {
+  auto Err = llvm::writeFileAtomically(
+    Path + "-%%%%%%%%.tmp", Path,
+    [&](llvm::raw_ostream &OS) {
+      // the files are large and written in one go
+      OS.SetBufferSize(1 << 16);
+      Write(OS);
+      return llvm::Error::success();
+    });
+  if (Err) {
+    llvm::errs() << "Failed to write " << Path << ": "
+                 << llvm::toString(std::move(Err)) << "\nData lost\n";
+    return false;
+  }
+  return true;
+}
+
+// The writers stream the records straight out of the results, laid out
+// exactly as yaml::Output lays out the items above, so the fast reader and
+// other consumers of the files see no difference.
+
+// a mapping key padded to the column yaml::Output puts values at
+static void writeYAMLKey(llvm::raw_ostream &OS, llvm::StringRef Key) {
+  OS << Key << ':';
+  OS.indent(Key.size() < 16 ? 16 - Key.size() : 1);
+}
+
+static void writeYAMLScalar(llvm::raw_ostream &OS, llvm::StringRef S) {
+  if (S.empty()) {
+    OS << "''";
+    return;
+  }
+  switch (llvm::yaml::needsQuotes(S)) {
+    case llvm::yaml::QuotingType::None:
+      OS << S;
+      break;
+    case llvm::yaml::QuotingType::Single:
+      OS << '\'';
+      for (char C : S) {
+        if (C == '\'') {
+          OS << '\'';
+        }
+        OS << C;
+      }
+      OS << '\'';
+      break;
+    case llvm::yaml::QuotingType::Double:
+      OS << '"' << llvm::yaml::escape(S, /*EscapePrintable=*/false) << '"';
+      break;
+  }
+}
+
+// Each writes a block sequence at Indent and returns whether it had any
+// items. Key is written before the first item if not empty, for sequences
+// nested in a mapping.
+static bool writeYAMLNames(llvm::raw_ostream &OS, const PerryResults &R,
+                           uint8_t Kinds, llvm::StringRef Key,
+                           unsigned Indent) {
+  auto Ids = R.getNames(Kinds);
+  if (Ids.empty()) {
+    return false;
+  }
+  if (!Key.empty()) {
+    OS << '\n' << Key << ':';
+  }
+  for (auto Id : Ids) {
+    OS << '\n';
+    OS.indent(Indent) << "- ";
+    writeYAMLScalar(OS, R.Strings.get(Id));
+  }
+  return true;
+}
+
+static bool writeYAMLApis(llvm::raw_ostream &OS, const PerryResults &R) {
+  auto Ids = R.getNames(PNK_Api);
+  for (auto Id : Ids) {
+    OS << "\n- ";
+    writeYAMLKey(OS, "api");
+    writeYAMLScalar(OS, R.Strings.get(Id));
+  }
+  return !Ids.empty();
+}
+
+static bool writeYAMLSuccRets(llvm::raw_ostream &OS, const PerryResults &R,
+                              llvm::StringRef Key, unsigned Indent) {
+  auto Ids = R.getNames(PNK_SuccRet);
+  if (Ids.empty()) {
+    return false;
+  }
+  if (!Key.empty()) {
+    OS << '\n' << Key << ':';
+  }
+  for (auto Id : Ids) {
+    OS << '\n';
+    OS.indent(Indent) << "- ";
+    writeYAMLKey(OS, "func");
+    writeYAMLScalar(OS, R.Strings.get(Id));
+    OS << '\n';
+    OS.indent(Indent + 2);
+    writeYAMLKey(OS, "succ_val");
+    OS << R.Names[Id].SuccVal;
+  }
+  return true;
+}
+
+static bool writeYAMLLoops(llvm::raw_ostream &OS, const PerryResults &R,
+                           llvm::StringRef Key, unsigned Indent) {
+  if (R.AllLoops.empty()) {
+    return false;
+  }
+  if (!Key.empty()) {
+    OS << '\n' << Key << ':';
+  }
+  R.forEachFileLoops([&](llvm::StringRef File,
+                         llvm::ArrayRef<PerryLoopItem> Loops) {
+    for (auto &L : Loops) {
+      OS << '\n';
+      OS.indent(Indent) << "- ";
+      writeYAMLKey(OS, "file");
+      writeYAMLScalar(OS, File);
+      std::pair<llvm::StringRef, unsigned> Fields[] = {
+        {"begin_line", L.beginLine}, {"begin_column", L.beginColumn},
+        {"end_line", L.endLine}, {"end_column", L.endColumn}
+      };
+      for (auto &F : Fields) {
+        OS << '\n';
+        OS.indent(Indent + 2);
+        writeYAMLKey(OS, F.first);
+        OS << F.second;
+      }
+    }
+  });
+  return true;
+}
+
+// a document holding a top-level sequence
+static void writeYAMLSequence(llvm::raw_ostream &OS,
+                              llvm::function_ref<bool()> WriteItems) {
+  OS << "---";
+  if (!WriteItems()) {
+    OS << "\n[]";
+  }
+  OS << "\n...\n";
+}
+
+// a document in shard format, empty sequences and strings are left out
+static void writeYAMLShard(llvm::raw_ostream &OS, const PerryResults &R,
+                           bool WithTU) {
+  OS << "---";
+  bool Any = false;
+  if (WithTU) {
+    std::pair<llvm::StringRef, llvm::StringRef> Fields[] = {
+      {"tu", R.TU}, {"output", R.Output}, {"fingerprint", R.Fingerprint}
+    };
+    for (auto &F : Fields) {
+      if (!F.second.empty()) {
+        OS << '\n';
+        writeYAMLKey(OS, F.first);
+        writeYAMLScalar(OS, F.second);
+        Any = true;
+      }
+    }
+  }
+  Any |= writeYAMLSuccRets(OS, R, "succ_ret", 2);
+  Any |= writeYAMLNames(OS, R, PNK_FuncDec, "func_dec", 2);
+  Any |= writeYAMLNames(OS, R, PNK_FuncDef, "func_def", 2);
+  Any |= writeYAMLLoops(OS, R, "loops", 2);
+  Any |= writeYAMLNames(OS, R, PNK_StructName, "periph_structs", 2);
+  if (!Any) {
+    OS << "\n{}";
+  }
+  OS << "\n...\n";
+}
+
+// The loaders try the fast reader first and fall back to yaml::Input. Adding a
+// record twice changes nothing, so it does not matter what the fast reader
+// added before giving up.
+bool SuccRetCacheLoader(const std::string &Path, PerryResults &R) {
+  std::unique_ptr<llvm::MemoryBuffer> Buffer;
+  if (!readFile(Path, Buffer)) {
+    return false;
+  }
+  if (!Buffer) {
+    return true;
+  }
+  auto AddItem = [&](const PerryFastYAMLReader::Item &I) {
+    llvm::StringRef FuncName;
+    uint64_t SuccVal;
+    if (I.size() != 2 || !I.get("func", FuncName) ||
+        !I.getInteger("succ_val", SuccVal)) {
+      return false;
+    }
+    R.addSuccRet(FuncName, SuccVal);
+    return true;
+  };
+  if (PerryFastYAMLReader(Buffer->getBuffer()).read(true, AddItem)) {
+    return true;
+  }
+  std::vector<PerryFuncRetItem> ReadItem;
+  if (!parseYAMLFile(Path, *Buffer, ReadItem)) {
+    return false;
+  }
+  for (auto &RI : ReadItem) {
+    R.addSuccRet(RI.FuncName, RI.SuccVal);
+  }
+  return true;
+}
+
+bool ApiCacheLoader(const std::string &Path, PerryResults &R) {
+  std::unique_ptr<llvm::MemoryBuffer> Buffer;
+  if (!readFile(Path, Buffer)) {
+    return false;
+  }
+  if (!Buffer) {
+    return true;
+  }
+  auto AddItem = [&](const PerryFastYAMLReader::Item &I) {
+    llvm::StringRef FuncName;
+    if (I.size() != 1 || !I.get("api", FuncName)) {
+      return false;
+    }
+    R.addName(FuncName, PNK_Api);
+    return true;
+  };
+  if (PerryFastYAMLReader(Buffer->getBuffer()).read(true, AddItem)) {
+    return true;
+  }
+  std::vector<PerryApiItem> ReadItem;
+  if (!parseYAMLFile(Path, *Buffer, ReadItem)) {
+    return false;
+  }
+  for (auto &RI : ReadItem) {
+    R.addName(RI.FuncName, PNK_Api);
+  }
+  return true;
+}
+
+static void addLoops(const std::vector<PerryLoopFileItem> &Loops,
+                     PerryResults &R) {
+  if (Loops.empty()) {
+    return;
+  }
+  for (auto &L : Loops) {
+    R.addLoop(L.FilePath, L.beginLine, L.beginColumn, L.endLine, L.endColumn);
+  }
+  R.sortLoops();
+}
+
+bool LoopCacheLoader(const std::string &Path, PerryResults &R) {
+  std::unique_ptr<llvm::MemoryBuffer> Buffer;
+  if (!readFile(Path, Buffer)) {
+    return false;
+  }
+  if (!Buffer) {
+    return true;
+  }
+  auto AddItem = [&](const PerryFastYAMLReader::Item &I) {
+    llvm::StringRef FilePath;
+    unsigned beginLine, beginColumn, endLine, endColumn;
+    if (I.size() != 5 || !I.get("file", FilePath) ||
+        !I.getInteger("begin_line", beginLine) ||
+        !I.getInteger("begin_column", beginColumn) ||
+        !I.getInteger("end_line", endLine) ||
+        !I.getInteger("end_column", endColumn)) {
+      return false;
+    }
+    R.addLoop(FilePath, beginLine, beginColumn, endLine, endColumn);
+    return true;
+  };
+  bool Fast = PerryFastYAMLReader(Buffer->getBuffer()).read(true, AddItem);
+  R.sortLoops();
+  if (Fast) {
+    return true;
+  }
+  std::vector<PerryLoopFileItem> ReadItem;
+  if (!parseYAMLFile(Path, *Buffer, ReadItem)) {
+    return false;
+  }
+  addLoops(ReadItem, R);
+  return true;
+}
+
+bool StructCacheLoader(const std::string &Path, PerryResults &R) {
+  std::unique_ptr<llvm::MemoryBuffer> Buffer;
+  if (!readFile(Path, Buffer)) {
+    return false;
+  }
+  if (!Buffer) {
+    return true;
+  }
+  auto AddItem = [&](const PerryFastYAMLReader::Item &I) {
+    llvm::StringRef Name;
+    I.get("", Name);
+    R.addStructName(Name);
+    return true;
+  };
+  if (PerryFastYAMLReader(Buffer->getBuffer()).read(false, AddItem)) {
+    return true;
+  }
+  std::vector<std::string> ReadItem;
+  if (!parseYAMLFile(Path, *Buffer, ReadItem)) {
+    return false;
+  }
+  for (auto &Name : ReadItem) {
+    R.addStructName(Name);
+  }
+  return true;
+}
+
+bool SuccRetCacheWriter(const std::string &Path, const PerryResults &R) {
+  return writeFile(Path, [&](llvm::raw_ostream &OS) {
+    writeYAMLSequence(OS, [&] { return writeYAMLSuccRets(OS, R, "", 0); });
+  });
+}
+
+bool ApiCacheWriter(const std::string &Path, const PerryResults &R) {
+  return writeFile(Path, [&](llvm::raw_ostream &OS) {
+    writeYAMLSequence(OS, [&] { return writeYAMLApis(OS, R); });
+  });
+}
+
+bool LoopCacheWriter(const std::string &Path, const PerryResults &R) {
+  return writeFile(Path, [&](llvm::raw_ostream &OS) {
+    writeYAMLSequence(OS, [&] { return writeYAMLLoops(OS, R, "", 0); });
+  });
+}
+
+bool StructCacheWriter(const std::string &Path, const PerryResults &R) {
+  return writeFile(Path, [&](llvm::raw_ostream &OS) {
+    writeYAMLSequence(OS, [&] {
+      return writeYAMLNames(OS, R, PNK_StructName, "", 0);
+    });
+  });
+}
+
+static void mergeShardItem(const PerryShardItem &Shard, PerryResults &R) {
+  for (auto &RI : Shard.SuccRet) {
+    R.addSuccRet(RI.FuncName, RI.SuccVal);
+  }
+  for (auto &Name : Shard.FuncDec) {
+    R.addFuncDec(Name);
+  }
+  for (auto &Name : Shard.FuncDef) {
+    R.addFuncDef(Name);
+  }
+  addLoops(Shard.Loops, R);
+  for (auto &Name : Shard.StructNames) {
+    R.addStructName(Name);
+  }
+}
+
+static bool writeShardItem(const std::string &Path, const PerryResults &R,
+                           bool WithTU) {
+  return writeFile(Path, [&](llvm::raw_ostream &OS) {
+    writeYAMLShard(OS, R, WithTU);
+  });
+}
+
+bool ShardLoader(const std::string &Path, PerryResults &R) {
+  PerryShardItem Shard;
+  if (!readYAMLFile(Path, Shard)) {
+    return false;
+  }
+  R.TU = Shard.TU;
+  R.Output = Shard.Output;
+  R.Fingerprint = Shard.Fingerprint;
+  mergeShardItem(Shard, R);
+  return true;
+}
+
+bool ShardWriter(const std::string &Path, const PerryResults &R) {
+  return writeShardItem(Path, R, true);
+}
+
+// union one or more serialized shards into U, a shard per document
+static bool UnitsFromString(llvm::StringRef Buffer, PerryUnits &U) {
+  if (Buffer.trim().empty()) {
+    return true;
+  }
+  llvm::yaml::Input yin(Buffer);
+  do {
+    PerryShardItem Shard;
+    yin >> Shard;
+    if (bool(yin.error())) {
+      return false;
+    }
+    PerryResults R;
+    R.TU = Shard.TU;
+    R.Output = Shard.Output;
+    R.Fingerprint = Shard.Fingerprint;
+    mergeShardItem(Shard, R);
+    U.replace(std::move(R));
+  } while (yin.nextDocument());
+  return true;
+}
+
+bool UnitsLoader(const std::string &Path, PerryUnits &U) {
+  std::unique_ptr<llvm::MemoryBuffer> Buffer;
+  if (!readFile(Path, Buffer)) {
+    return false;
+  }
+  if (Buffer && !UnitsFromString(Buffer->getBuffer(), U)) {
+    llvm::errs() << "Failed to read data from " << Path << "\n";
+    return false;
+  }
+  return true;
+}
+
+bool UnitsWriter(const std::string &Path, const PerryUnits &U) {
+  return writeFile(Path, [&](llvm::raw_ostream &OS) {
+    for (auto &Unit : U.Units) {
+      writeYAMLShard(OS, Unit.second, true);
+    }
+  });
+}
+
+std::string getUnitsPath(const std::string &Path) {
+  return Path + ".units";
+}
+
+bool isUnitsFileCurrent(const std::string &Path) {
+  llvm::sys::fs::file_status Status, UnitsStatus;
+  if (llvm::sys::fs::status(Path, Status)) {
+    // nothing to seed from
+    return true;
+  }
+  if (llvm::sys::fs::status(getUnitsPath(Path), UnitsStatus)) {
+    return false;
+  }
+  return UnitsStatus.getLastModificationTime() >=
+         Status.getLastModificationTime();
+}
+
+bool DatabaseLoader(const std::string &Path, PerryResults &R) {
+  PerryUnits U;
+  if (!UnitsLoader(Path, U)) {
+    return false;
+  }
+  U.combine(R);
+  return true;
+}
+
+bool DatabaseWriter(const std::string &Path, const PerryResults &R) {
+  return writeShardItem(Path, R, false);
+}
+
+bool SpillWriter(
+    const std::string &Path,
+    const std::function<bool(const std::string &, const PerryResults &)> &Writer,
+    const PerryResults &R) {
+  llvm::SmallString<128> Spill;
+  llvm::sys::fs::createUniquePath(Path + ".spill-%%%%%%%%", Spill, false);
+  return Writer(Spill.str().str(), R);
+}
+
+bool SpillWriter(const std::string &Path, const PerryUnits &U) {
+  llvm::SmallString<128> Spill;
+  llvm::sys::fs::createUniquePath(Path + ".spill-%%%%%%%%", Spill, false);
+  return UnitsWriter(Spill.str().str(), U);
+}
+
+std::vector<std::string> getSpillFiles(const std::string &Path) {
+  std::vector<std::string> Spills;
+  llvm::SmallString<128> Dir = llvm::sys::path::parent_path(Path);
+  if (Dir.empty()) {
+    Dir = ".";
+  }
+  std::string Prefix = (llvm::sys::path::filename(Path) + ".spill-").str();
+  std::error_code err_code;
+  for (llvm::sys::fs::directory_iterator it(Dir, err_code), it_end;
+       it != it_end && !err_code; it.increment(err_code)) {
+    llvm::StringRef Name = llvm::sys::path::filename(it->path());
+    if (Name.startswith(Prefix) && !Name.endswith(".tmp")) {
+      Spills.push_back(it->path());
+    }
+  }
+  return Spills;
+}
+
+std::string ShardToString(const PerryResults &R) {
+  std::string Buffer;
+  llvm::raw_string_ostream OS(Buffer);
+  writeYAMLShard(OS, R, true);
+  return OS.str();
+}
+
+bool ShardFromString(llvm::StringRef Buffer, PerryResults &R) {
+  if (Buffer.trim().empty()) {
+    return true;
+  }
+  // every entry is a document of its own
+  llvm::yaml::Input yin(Buffer);
+  do {
+    PerryShardItem Shard;
+    yin >> Shard;
+    if (bool(yin.error())) {
+      return false;
+    }
+    mergeShardItem(Shard, R);
+  } while (yin.nextDocument());
+  return true;
+}
+
+bool JournalLoader(const std::string &Path, PerryResults &R) {
+  std::unique_ptr<llvm::MemoryBuffer> Buffer;
+  if (!readFile(Path, Buffer)) {
+    return false;
+  }
+  if (Buffer && !ShardFromString(Buffer->getBuffer(), R)) {
+    llvm::errs() << "Failed to read data from " << Path << "\n";
+    return false;
+  }
+  return true;
+}
+
+bool JournalAppend(const std::string &Path, const PerryResults &R) {
+  std::string Buffer = ShardToString(R);
+  while (true) {
+    int FD;
+    std::error_code EC = llvm::sys::fs::openFileForWrite(
+      Path, FD, llvm::sys::fs::CD_OpenAlways, llvm::sys::fs::OF_Append);
+    if (EC) {
+      llvm::errs() << "Failed to open " << Path << " for append: "
+                   << EC.message() << "\nData lost\n";
+      return false;
+    }
+    // compaction moves the journal aside and then locks it exclusively, so
+    // hold a shared lock while appending and make sure the file we locked is
+    // still the one at Path
+    llvm::sys::fs::file_status Opened, Current;
+    if (::flock(FD, LOCK_SH) ||
+        llvm::sys::fs::status(FD, Opened) ||
+        llvm::sys::fs::status(Path, Current) ||
+        !llvm::sys::fs::equivalent(Opened, Current)) {
+      ::close(FD);
+      continue;
+    }
+    // a single write with O_APPEND never interleaves with other appenders
+    llvm::raw_fd_ostream OS(FD, /*shouldClose=*/true, /*unbuffered=*/true);
+    OS << Buffer;
+    if (OS.has_error()) {
+      llvm::errs() << "Failed to append to " << Path << ": "
+                   << OS.error().message() << "\nData lost\n";
+      OS.clear_error();
+      return false;
+    }
+    return true;
+  }
+}
+
+// move the journal aside and read it with Load once appenders are done
+static bool takeJournal(const std::string &Path, std::string &Taken,
+                        llvm::function_ref<bool(const std::string &)> Load) {
+  Taken.clear();
+  llvm::SmallString<128> TakenPath;
+  llvm::sys::fs::createUniquePath(Path + ".compact-%%%%%%%%", TakenPath,
+                                  /*MakeAbsolute=*/false);
+  if (llvm::sys::fs::rename(Path, TakenPath)) {
+    // nothing to compact, or someone else took it first
+    return true;
+  }
+  Taken = TakenPath.str().str();
+  int FD;
+  std::error_code EC = llvm::sys::fs::openFileForRead(Taken, FD);
+  if (EC) {
+    llvm::errs() << "Failed to open " << Taken << " for read: "
+                 << EC.message() << "\n";
+    return false;
+  }
+  // wait for appenders that opened the journal before it was moved
+  ::flock(FD, LOCK_EX);
+  bool Ret = Load(Taken);
+  ::close(FD);
+  return Ret;
+}
+
+bool JournalTake(const std::string &Path, PerryUnits &U,
+                 std::string &Taken) {
+  return takeJournal(Path, Taken, [&](const std::string &Taken) {
+    return UnitsLoader(Taken, U);
+  });
+}
+
+bool JournalTake(const std::string &Path, PerryResults &R,
+                 std::string &Taken) {
+  return takeJournal(Path, Taken, [&](const std::string &Taken) {
+    return JournalLoader(Taken, R);
+  });
+}
+
+bool StatsAppend(const std::string &Path, llvm::StringRef Line) {
+  int FD;
+  std::error_code EC = llvm::sys::fs::openFileForWrite(
+    Path, FD, llvm::sys::fs::CD_OpenAlways, llvm::sys::fs::OF_Append);
+  if (EC) {
+    llvm::errs() << "Failed to open " << Path << " for append: "
+                 << EC.message() << "\n";
+    return false;
+  }
+  // a single write with O_APPEND never interleaves with other TUs
+  llvm::raw_fd_ostream OS(FD, /*shouldClose=*/true, /*unbuffered=*/true);
+  OS << Line;
+  if (OS.has_error()) {
+    llvm::errs() << "Failed to append to " << Path << ": "
+                 << OS.error().message() << "\n";
+    OS.clear_error();
+    return false;
+  }
+  return true;
+}
+
+std::string getShardFileName(llvm::StringRef TU, llvm::StringRef OutputFile) {
+  std::string Key = (TU + llvm::Twine('\0') + OutputFile).str();
+  std::string Name;
+  llvm::raw_string_ostream OS(Name);
+  OS << llvm::sys::path::filename(TU) << "-"
+     << llvm::format_hex_no_prefix(llvm::xxHash64(Key), 16) << ".yaml";
+  return OS.str();
+}
@@ -0,0 +1,294 @@
+#include "PerryResults.h"
+
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Layout of the shared table file:
+//  * the header
+//  * NumSlots slots, each the arena offset of a record or 0 if empty
+//  * the arena, records are allocated by bumping ArenaUsed and never freed
+// Records are written privately and published by a CAS on an empty slot, so
+// inserts from any number of processes proceed without a lock, and a process
+// dying in the middle leaves at most some unused arena bytes behind.
+static constexpr char PerrySharedMagic[8] = {'P', 'E', 'R', 'R',
+                                             'Y', 'S', 'H', 'M'};
+static constexpr uint32_t PerrySharedVersion = 1;
+static constexpr uint64_t PerrySharedNumSlots = 1 << 20;
+static constexpr uint64_t PerrySharedArenaSize = 256 << 20;
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "the shared table needs lock-free 64-bit atomics");
+
+namespace {
+struct SharedHeader {
+  char Magic[8];
+  uint32_t Version;
+  uint32_t Reserved;
+  uint64_t NumSlots;
+  uint64_t ArenaSize;
+  std::atomic<uint64_t> ArenaUsed;
+  std::atomic<uint64_t> NumEntries;
+};
+
+enum SharedRecordKind : uint32_t {
+  SRK_SuccRet = 0,
+  SRK_FuncDec,
+  SRK_FuncDef,
+  SRK_Loop,
+  SRK_StructName
+};
+
+struct SharedRecord {
+  uint64_t Hash;
+  uint32_t Kind;
+  uint32_t Length;
+  // success value of SRK_SuccRet
+  uint64_t Value;
+  // followed by Length bytes of key: the name, or for SRK_Loop the file path
+  // followed by the four line/column numbers
+};
+
+class SharedTable {
+public:
+  ~SharedTable() {
+    if (Base) {
+      ::munmap(Base, Size);
+    }
+  }
+
+  bool open(const std::string &Path, bool Create);
+
+  // returns false if the table is full
+  bool insert(SharedRecordKind Kind, llvm::StringRef Key, uint64_t Value = 0);
+
+  template<typename Fn>
+  void forEach(Fn Callback) const {
+    for (uint64_t i = 0; i < Header->NumSlots; ++i) {
+      uint64_t Off = Slots[i].load(std::memory_order_acquire);
+      if (Off) {
+        auto *Rec = record(Off);
+        Callback(*Rec, llvm::StringRef(key(Rec), Rec->Length));
+      }
+    }
+  }
+
+private:
+  char *Base = nullptr;
+  size_t Size = 0;
+  SharedHeader *Header = nullptr;
+  std::atomic<uint64_t> *Slots = nullptr;
+  char *Arena = nullptr;
+
+  SharedRecord *record(uint64_t Off) const {
+    return reinterpret_cast<SharedRecord *>(Arena + Off);
+  }
+  static const char *key(const SharedRecord *Rec) {
+    return reinterpret_cast<const char *>(Rec + 1);
+  }
+  static bool matches(const SharedRecord *Rec, uint64_t Hash,
+                      SharedRecordKind Kind, llvm::StringRef Key) {
+    return Rec->Hash == Hash && Rec->Kind == Kind &&
+           llvm::StringRef(key(Rec), Rec->Length) == Key;
+  }
+};
+} // namespace
+
+static size_t getSharedTableSize(uint64_t NumSlots, uint64_t ArenaSize) {
+  return sizeof(SharedHeader) + NumSlots * sizeof(uint64_t) + ArenaSize;
+}
+
+bool SharedTable::open(const std::string &Path, bool Create) {
+  int FD = ::open(Path.c_str(), Create ? (O_RDWR | O_CREAT) : O_RDWR, 0644);
+  if (FD < 0) {
+    llvm::errs() << "Failed to open " << Path << ": "
+                 << std::strerror(errno) << "\n";
+    return false;
+  }
+  // the lock is only held to set up a new table
+  struct stat St;
+  if (::flock(FD, LOCK_EX) || ::fstat(FD, &St)) {
+    ::close(FD);
+    return false;
+  }
+  bool Fresh = St.st_size == 0;
+  if (Fresh) {
+    if (!Create) {
+      ::close(FD);
+      return false;
+    }
+    // the file is sparse, pages are only allocated once they are used
+    SharedHeader H = {};
+    std::memcpy(H.Magic, PerrySharedMagic, sizeof(PerrySharedMagic));
+    H.Version = PerrySharedVersion;
+    H.NumSlots = PerrySharedNumSlots;
+    H.ArenaSize = PerrySharedArenaSize;
+    // offset 0 marks empty slots
+    H.ArenaUsed = alignof(SharedRecord);
+    St.st_size = getSharedTableSize(H.NumSlots, H.ArenaSize);
+    if (::ftruncate(FD, St.st_size) ||
+        ::pwrite(FD, &H, sizeof(H), 0) != (ssize_t)sizeof(H)) {
+      llvm::errs() << "Failed to set up " << Path << ": "
+                   << std::strerror(errno) << "\n";
+      ::ftruncate(FD, 0);
+      ::close(FD);
+      return false;
+    }
+  }
+  ::flock(FD, LOCK_UN);
+
+  void *Addr = ::mmap(nullptr, St.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      FD, 0);
+  ::close(FD);
+  if (Addr == MAP_FAILED) {
+    llvm::errs() << "Failed to map " << Path << ": "
+                 << std::strerror(errno) << "\n";
+    return false;
+  }
+  Base = static_cast<char *>(Addr);
+  Size = St.st_size;
+  Header = reinterpret_cast<SharedHeader *>(Base);
+  if (Size < sizeof(SharedHeader) ||
+      std::memcmp(Header->Magic, PerrySharedMagic, sizeof(PerrySharedMagic)) ||
+      Header->Version != PerrySharedVersion ||
+      Size != getSharedTableSize(Header->NumSlots, Header->ArenaSize) ||
+      !llvm::isPowerOf2_64(Header->NumSlots)) {
+    llvm::errs() << Path << " is not a shared table\n";
+    return false;
+  }
+  Slots = reinterpret_cast<std::atomic<uint64_t> *>(Base + sizeof(SharedHeader));
+  Arena = Base + sizeof(SharedHeader) + Header->NumSlots * sizeof(uint64_t);
+  return true;
+}
+
+bool SharedTable::insert(SharedRecordKind Kind, llvm::StringRef Key,
+                         uint64_t Value) {
+  uint64_t Hash = llvm::xxHash64(Key) ^ Kind;
+  uint64_t Mask = Header->NumSlots - 1;
+  uint64_t Mine = 0;
+  for (uint64_t i = Hash & Mask, Probes = 0; Probes <= Mask;
+       i = (i + 1) & Mask, ++Probes) {
+    uint64_t Off = Slots[i].load(std::memory_order_acquire);
+    if (!Off) {
+      // keep the table sparse enough for probing to stay short
+      if (Header->NumEntries.load(std::memory_order_relaxed) >=
+          Header->NumSlots / 4 * 3) {
+        return false;
+      }
+      if (!Mine) {
+        // write our record before publishing it
+        uint64_t RecSize = llvm::alignTo(sizeof(SharedRecord) + Key.size(),
+                                         alignof(SharedRecord));
+        Mine = Header->ArenaUsed.fetch_add(RecSize, std::memory_order_relaxed);
+        if (Mine + RecSize > Header->ArenaSize) {
+          return false;
+        }
+        auto *Rec = record(Mine);
+        Rec->Hash = Hash;
+        Rec->Kind = Kind;
+        Rec->Length = Key.size();
+        Rec->Value = Value;
+        std::memcpy(const_cast<char *>(key(Rec)), Key.data(), Key.size());
+      }
+      if (Slots[i].compare_exchange_strong(Off, Mine,
+                                           std::memory_order_acq_rel,
+                                           std::memory_order_acquire)) {
+        Header->NumEntries.fetch_add(1, std::memory_order_relaxed);
+        return true;
+      }
+      // somebody else took the slot, Off is theirs now
+    }
+    if (matches(record(Off), Hash, Kind, Key)) {
+      // already there, the first success value wins as with the other outputs
+      return true;
+    }
+  }
+  return false;
+}
+
+static std::string getLoopKey(const PerryResults &R, const PerryLoopItem &L) {
+  std::string Key = R.Strings.get(L.File).str();
+  uint32_t Pos[4] = {L.beginLine, L.beginColumn, L.endLine, L.endColumn};
+  Key.append(reinterpret_cast<const char *>(Pos), sizeof(Pos));
+  return Key;
+}
+
+bool SharedTableInsert(const std::string &Path, const PerryResults &R) {
+  SharedTable Table;
+  if (!Table.open(Path, true)) {
+    return false;
+  }
+  bool Ok = true;
+  for (uint32_t Id = 0; Ok && Id < R.Names.size(); ++Id) {
+    auto &N = R.Names[Id];
+    llvm::StringRef Name = R.Strings.get(Id);
+    if (N.Kinds & PNK_SuccRet) {
+      Ok = Ok && Table.insert(SRK_SuccRet, Name, N.SuccVal);
+    }
+    if (N.Kinds & PNK_FuncDec) {
+      Ok = Ok && Table.insert(SRK_FuncDec, Name);
+    }
+    if (N.Kinds & PNK_FuncDef) {
+      Ok = Ok && Table.insert(SRK_FuncDef, Name);
+    }
+    if (N.Kinds & PNK_StructName) {
+      Ok = Ok && Table.insert(SRK_StructName, Name);
+    }
+  }
+  for (auto &L : R.AllLoops) {
+    Ok = Ok && Table.insert(SRK_Loop, getLoopKey(R, L));
+  }
+  if (!Ok) {
+    llvm::errs() << Path << " is full\n";
+  }
+  return Ok;
+}
+
+bool SharedTableLoader(const std::string &Path, PerryResults &R) {
+  // nothing was inserted, e.g. every TU spilled its records
+  if (!llvm::sys::fs::exists(Path)) {
+    return true;
+  }
+  SharedTable Table;
+  if (!Table.open(Path, false)) {
+    return false;
+  }
+  Table.forEach([&](const SharedRecord &Rec, llvm::StringRef Key) {
+    switch (Rec.Kind) {
+      case SRK_SuccRet:
+        R.addSuccRet(Key, Rec.Value);
+        break;
+      case SRK_FuncDec:
+        R.addFuncDec(Key);
+        break;
+      case SRK_FuncDef:
+        R.addFuncDef(Key);
+        break;
+      case SRK_Loop: {
+        uint32_t Pos[4];
+        if (Key.size() < sizeof(Pos)) {
+          break;
+        }
+        std::memcpy(Pos, Key.end() - sizeof(Pos), sizeof(Pos));
+        R.addLoop(Key.drop_back(sizeof(Pos)), Pos[0], Pos[1], Pos[2], Pos[3]);
+        break;
+      }
+      case SRK_StructName:
+        R.addStructName(Key);
+        break;
+    }
+  });
+  R.sortLoops();
+  return true;
+}
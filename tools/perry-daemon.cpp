@@ -0,0 +1,252 @@
+#include "PerryDaemon.h"
+
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/LockFileManager.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace llvm;
+
+static cl::opt<std::string>
+SocketPath("socket", cl::Required,
+           cl::desc("Unix domain socket to listen on, or to talk to"));
+
+static cl::opt<bool>
+Flush("flush", cl::desc("Ask a running daemon to write the output files"));
+
+static cl::opt<bool>
+Shutdown("shutdown",
+         cl::desc("Ask a running daemon to write the output files and exit"));
+
+static cl::opt<std::string>
+OutFileSuccRet("out-file-succ-ret", cl::init(""),
+               cl::desc("Output success return file"));
+
+static cl::opt<std::string>
+OutFileApi("out-file-api", cl::init(""), cl::desc("Output API file"));
+
+static cl::opt<std::string>
+OutFileLoops("out-file-loops", cl::init(""), cl::desc("Output loops file"));
+
+static cl::opt<std::string>
+OutFileStructNames("out-file-periph-struct", cl::init(""),
+                   cl::desc("Output peripheral struct name file"));
+
+static cl::opt<std::string>
+OutFileIndex("out-file-index", cl::init(""),
+             cl::desc("Also write the binary index read by PerryIndexReader"));
+
+// lock-free, so the signal handler may set it too
+static std::atomic<bool> Stop(false);
+static int Listen = -1;
+
+// any thread may take the signal, so wake up accept() on the main thread by
+// shutting the socket down rather than relying on EINTR
+static void stop_listening() {
+  Stop = true;
+  ::shutdown(Listen, SHUT_RDWR);
+}
+
+static void on_signal(int) {
+  stop_listening();
+}
+
+// the files may also be updated by compiler processes that could not reach
+// the daemon, so take the same lock they do and keep what they wrote or
+// spilled
+static bool update_locked(
+    const std::string &Path,
+    std::function<bool(const std::string &, PerryResults &)> loader,
+    std::function<bool(const std::string &, const PerryResults &)> writer,
+    PerryResults &R) {
+  while (true) {
+    LockFileManager Locked(Path);
+    switch (Locked) {
+      case LockFileManager::LFS_Shared:
+        Locked.waitForUnlock();
+        continue;
+      case LockFileManager::LFS_Error:
+        Locked.unsafeRemoveLockFile();
+        LLVM_FALLTHROUGH;
+      case LockFileManager::LFS_Owned: {
+        std::vector<std::string> Folded;
+        for (auto &Spill : getSpillFiles(Path)) {
+          if (loader(Spill, R)) {
+            Folded.push_back(Spill);
+          }
+        }
+        if (!loader(Path, R) || !writer(Path, R)) {
+          return false;
+        }
+        for (auto &Spill : Folded) {
+          sys::fs::remove(Spill);
+        }
+        return true;
+      }
+    }
+  }
+}
+
+static bool flush_outputs(PerryResults &All) {
+  bool Ok = update_locked(OutFileSuccRet, SuccRetCacheLoader,
+                          SuccRetCacheWriter, All);
+  Ok &= update_locked(OutFileApi, ApiCacheLoader, ApiCacheWriter, All);
+  Ok &= update_locked(OutFileLoops, LoopCacheLoader, LoopCacheWriter, All);
+  Ok &= update_locked(OutFileStructNames, StructCacheLoader,
+                      StructCacheWriter, All);
+  if (!OutFileIndex.empty()) {
+    Ok &= IndexWriter(OutFileIndex, All);
+  }
+  return Ok;
+}
+
+static int listen_on(const std::string &Path) {
+  struct sockaddr_un Addr;
+  if (Path.size() >= sizeof(Addr.sun_path)) {
+    errs() << "Socket path too long: " << Path << "\n";
+    return -1;
+  }
+  std::memset(&Addr, 0, sizeof(Addr));
+  Addr.sun_family = AF_UNIX;
+  std::memcpy(Addr.sun_path, Path.c_str(), Path.size());
+
+  int FD = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (FD < 0) {
+    errs() << "Failed to create socket: " << std::strerror(errno) << "\n";
+    return -1;
+  }
+  // a socket left behind by a daemon that died refuses connections
+  if (!::connect(FD, (struct sockaddr *)&Addr, sizeof(Addr))) {
+    errs() << "Another daemon is listening on " << Path << "\n";
+    ::close(FD);
+    return -1;
+  }
+  ::unlink(Path.c_str());
+  if (::bind(FD, (struct sockaddr *)&Addr, sizeof(Addr)) ||
+      ::listen(FD, SOMAXCONN)) {
+    errs() << "Failed to listen on " << Path << ": "
+           << std::strerror(errno) << "\n";
+    ::close(FD);
+    return -1;
+  }
+  return FD;
+}
+
+int main(int argc, char *argv[]) {
+  cl::ParseCommandLineOptions(argc, argv,
+                              "Collect Perry results from compiler processes\n");
+  if (Flush || Shutdown) {
+    return DaemonSendCommand(SocketPath, Shutdown ? PerryDaemonShutdown
+                                                  : PerryDaemonFlush) ? 0 : 1;
+  }
+  if (OutFileSuccRet.empty() || OutFileApi.empty() || OutFileLoops.empty() ||
+      OutFileStructNames.empty()) {
+    errs() << "All four output files are required\n";
+    return 1;
+  }
+
+  Listen = listen_on(SocketPath);
+  if (Listen < 0) {
+    return 1;
+  }
+  struct sigaction SA;
+  std::memset(&SA, 0, sizeof(SA));
+  SA.sa_handler = on_signal;
+  ::sigaction(SIGINT, &SA, nullptr);
+  ::sigaction(SIGTERM, &SA, nullptr);
+  ::signal(SIGPIPE, SIG_IGN);
+
+  // every connection is handled on a thread of its own, so a slow or stuck
+  // client only holds up itself. Records are parsed there and merged under
+  // Mutex
+  std::mutex Mutex;
+  std::condition_variable Idle;
+  unsigned Active = 0;
+  PerryResults All;
+  bool Dirty = false;
+  unsigned NumRecords = 0;
+  auto handle = [&](int Conn) {
+    // a stuck client gives up its thread after a while
+    struct timeval Timeout = {10, 0};
+    ::setsockopt(Conn, SOL_SOCKET, SO_RCVTIMEO, &Timeout, sizeof(Timeout));
+
+    std::string Request;
+    bool Ok = DaemonReadAll(Conn, Request);
+    if (Ok) {
+      StringRef Verb, Payload;
+      std::tie(Verb, Payload) = StringRef(Request).split('\n');
+      if (Verb == PerryDaemonRecords) {
+        PerryResults R;
+        Ok = ShardFromString(Payload, R);
+        if (Ok) {
+          std::lock_guard<std::mutex> Lock(Mutex);
+          All.merge(R);
+          Dirty = true;
+          ++NumRecords;
+        }
+      } else if (Verb == PerryDaemonFlush || Verb == PerryDaemonShutdown) {
+        {
+          std::lock_guard<std::mutex> Lock(Mutex);
+          Ok = flush_outputs(All);
+          Dirty = !Ok;
+        }
+        if (Verb == PerryDaemonShutdown) {
+          stop_listening();
+        }
+      } else {
+        Ok = false;
+      }
+    }
+    DaemonWriteAll(Conn, (Twine(Ok ? PerryDaemonOk : PerryDaemonError) +
+                          "\n").str());
+    ::close(Conn);
+    std::lock_guard<std::mutex> Lock(Mutex);
+    if (!--Active) {
+      Idle.notify_all();
+    }
+  };
+  while (!Stop) {
+    int Conn = ::accept4(Listen, nullptr, nullptr, SOCK_CLOEXEC);
+    if (Conn < 0) {
+      if (Stop) {
+        break;
+      }
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      errs() << "Failed to accept: " << std::strerror(errno) << "\n";
+      break;
+    }
+    {
+      std::lock_guard<std::mutex> Lock(Mutex);
+      ++Active;
+    }
+    std::thread([&handle, Conn]() { handle(Conn); }).detach();
+  }
+  // connections accepted so far are still answered
+  {
+    std::unique_lock<std::mutex> Lock(Mutex);
+    Idle.wait(Lock, [&]() { return !Active; });
+  }
+
+  ::close(Listen);
+  ::unlink(SocketPath.c_str());
+  if (Dirty && !flush_outputs(All)) {
+    return 1;
+  }
+  outs() << "Received records of " << NumRecords << " translation units\n";
+  return 0;
+}
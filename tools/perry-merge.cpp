@@ -0,0 +1,292 @@
+#include "PerryResults.h"
+
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <atomic>
+
+using namespace llvm;
+
+static cl::list<std::string>
+ShardDirs(cl::Positional, cl::ZeroOrMore,
+          cl::desc("<shard directories written with -out-shard-dir>"));
+
+static cl::list<std::string>
+Databases("db", cl::ZeroOrMore,
+          cl::desc("Database written with -out-file-db to export"));
+
+static cl::list<std::string>
+SharedTables("shm", cl::ZeroOrMore,
+             cl::desc("Shared table written with -out-file-shm to export"));
+
+static cl::list<std::string>
+Journals("journal", cl::ZeroOrMore,
+         cl::desc("Journal written with -out-file-journal to compact into "
+                  "the output files"));
+
+static cl::opt<bool>
+FoldSpills("fold-spills",
+           cl::desc("Keep the content of the output files and fold in the "
+                    "records spilled next to them"));
+
+static cl::opt<bool>
+Provenance("provenance",
+           cl::desc("The records were written with -provenance: only the "
+                    "last journal entry of a TU counts, and the units files "
+                    "next to the output files replace its old records"));
+
+static cl::opt<std::string>
+OutFileSuccRet("out-file-succ-ret", cl::Required,
+               cl::desc("Output success return file"));
+
+static cl::opt<std::string>
+OutFileApi("out-file-api", cl::Required, cl::desc("Output API file"));
+
+static cl::opt<std::string>
+OutFileLoops("out-file-loops", cl::Required, cl::desc("Output loops file"));
+
+static cl::opt<std::string>
+OutFileStructNames("out-file-periph-struct", cl::Required,
+                   cl::desc("Output peripheral struct name file"));
+
+static cl::opt<std::string>
+OutFileIndex("out-file-index", cl::init(""),
+             cl::desc("Also write the binary index read by PerryIndexReader"));
+
+static cl::opt<unsigned>
+Jobs("j", cl::init(0),
+     cl::desc("Number of threads, default to the number of cores"));
+
+static void collect_shards(const std::string &Dir,
+                           std::vector<std::string> &Shards) {
+  std::error_code err_code;
+  for (sys::fs::directory_iterator it(Dir, err_code), it_end;
+       it != it_end && !err_code; it.increment(err_code)) {
+    if (sys::path::extension(it->path()) == ".yaml") {
+      Shards.push_back(it->path());
+    }
+  }
+  if (err_code) {
+    errs() << "Failed to read " << Dir << ": " << err_code.message() << "\n";
+    exit(1);
+  }
+}
+
+// left behind by compactions that did not finish
+static void collect_taken_journals(const std::string &Journal,
+                                   std::vector<std::string> &Taken) {
+  SmallString<128> Dir = sys::path::parent_path(Journal);
+  if (Dir.empty()) {
+    Dir = ".";
+  }
+  std::string Prefix = (sys::path::filename(Journal) + ".compact-").str();
+  std::error_code err_code;
+  for (sys::fs::directory_iterator it(Dir, err_code), it_end;
+       it != it_end && !err_code; it.increment(err_code)) {
+    if (sys::path::filename(it->path()).startswith(Prefix)) {
+      Taken.push_back(it->path());
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  cl::ParseCommandLineOptions(argc, argv, "Merge Perry result shards\n");
+  if (ShardDirs.empty() && Databases.empty() && SharedTables.empty() &&
+      Journals.empty() && !FoldSpills) {
+    errs() << "No shard directory, database, shared table or journal given\n";
+    return 1;
+  }
+
+  std::vector<std::string> Shards;
+  for (auto &Dir : ShardDirs) {
+    collect_shards(Dir, Shards);
+  }
+
+  // every worker unions a strided subset of the shards into its own results,
+  // partial results are combined once all of them are done
+  ThreadPool Pool(hardware_concurrency(Jobs));
+  unsigned NumWorkers = std::max(1u, Pool.getThreadCount());
+  std::vector<PerryResults> Partial(NumWorkers);
+  std::atomic<bool> Failed(false);
+  for (unsigned w = 0; w < NumWorkers; ++w) {
+    Pool.async([&, w]() {
+      for (size_t i = w; i < Shards.size(); i += NumWorkers) {
+        if (!ShardLoader(Shards[i], Partial[w])) {
+          Failed = true;
+        }
+      }
+    });
+  }
+  Pool.wait();
+  if (Failed) {
+    // keep the previous outputs rather than writing an incomplete union
+    errs() << "Failed to read all shards, no output written\n";
+    return 1;
+  }
+
+  PerryResults All;
+  for (auto &P : Partial) {
+    All.merge(P);
+  }
+  Partial.clear();
+
+  // a database holds a shard per TU with -provenance, and what was spilled
+  // next to it is newer
+  std::vector<std::string> Spills;
+  for (auto &DB : Databases) {
+    PerryUnits Units;
+    if (!UnitsLoader(DB, Units)) {
+      return 1;
+    }
+    for (auto &Spill : getSpillFiles(DB)) {
+      if (!UnitsLoader(Spill, Units)) {
+        return 1;
+      }
+      Spills.push_back(Spill);
+    }
+    Units.combine(All);
+  }
+
+  for (auto &Table : SharedTables) {
+    if (!SharedTableLoader(Table, All)) {
+      return 1;
+    }
+  }
+
+  // entries are unioned, or with -provenance the last entry of a TU counts,
+  // and compactions left behind are older
+  PerryUnits Journaled;
+  std::vector<std::string> Taken;
+  for (auto &Journal : Journals) {
+    std::vector<std::string> Left;
+    collect_taken_journals(Journal, Left);
+    for (auto &L : Left) {
+      if (Provenance ? !UnitsLoader(L, Journaled) : !JournalLoader(L, All)) {
+        return 1;
+      }
+      Taken.push_back(L);
+    }
+    std::string T;
+    if (Provenance ? !JournalTake(Journal, Journaled, T)
+                   : !JournalTake(Journal, All, T)) {
+      return 1;
+    }
+    if (!T.empty()) {
+      Taken.push_back(T);
+    }
+  }
+  Journaled.combine(All);
+
+  // journals may have been compacted into the output files during the build,
+  // so their content is kept then. With -provenance, the units kept next to
+  // them take the journaled TUs instead of their old records, and are written
+  // back after the files. Records the units miss, from spills or writes
+  // without -provenance, are kept under no TU. Records spilled next to the
+  // output files, e.g., by TUs the daemon did not take, never made it into
+  // them and are folded in even if the files are replaced.
+  std::vector<std::pair<std::string, PerryUnits>> Kept;
+  bool KeepOutputs = !Journals.empty() || FoldSpills;
+  struct Output {
+    std::string Path;
+    std::function<bool(const std::string &, PerryResults &)> Loader;
+    uint8_t Kinds;
+    bool Loops;
+  };
+  Output Outputs[] = {
+    {OutFileSuccRet, SuccRetCacheLoader, PNK_SuccRet, false},
+    {OutFileApi, ApiCacheLoader, PNK_Api, false},
+    {OutFileLoops, LoopCacheLoader, 0, true},
+    {OutFileStructNames, StructCacheLoader, PNK_StructName, false}
+  };
+  for (auto &O : Outputs) {
+    std::string UnitsPath = getUnitsPath(O.Path);
+    if (KeepOutputs && Provenance) {
+      PerryUnits Units;
+      if (!UnitsLoader(UnitsPath, Units)) {
+        return 1;
+      }
+      for (auto &Spill : getSpillFiles(UnitsPath)) {
+        if (!UnitsLoader(Spill, Units)) {
+          return 1;
+        }
+        Spills.push_back(Spill);
+      }
+      PerryResults Found;
+      if (!isUnitsFileCurrent(O.Path) && !O.Loader(O.Path, Found)) {
+        return 1;
+      }
+      for (auto &Spill : getSpillFiles(O.Path)) {
+        if (!O.Loader(Spill, Found)) {
+          return 1;
+        }
+        Spills.push_back(Spill);
+      }
+      Units.seed(Found);
+      for (auto &U : Journaled.Units) {
+        Units.replace(U.second.select(O.Kinds, O.Loops));
+      }
+      Units.combine(All);
+      Kept.emplace_back(UnitsPath, std::move(Units));
+      continue;
+    }
+    if (KeepOutputs && !O.Loader(O.Path, All)) {
+      return 1;
+    }
+    for (auto &Spill : getSpillFiles(O.Path)) {
+      if (!O.Loader(Spill, All)) {
+        return 1;
+      }
+      Spills.push_back(Spill);
+    }
+  }
+  Journaled.Units.clear();
+
+  Pool.async([&]() {
+    if (!SuccRetCacheWriter(OutFileSuccRet, All)) Failed = true;
+  });
+  Pool.async([&]() {
+    if (!ApiCacheWriter(OutFileApi, All)) Failed = true;
+  });
+  Pool.async([&]() {
+    if (!LoopCacheWriter(OutFileLoops, All)) Failed = true;
+  });
+  Pool.async([&]() {
+    if (!StructCacheWriter(OutFileStructNames, All)) Failed = true;
+  });
+  if (!OutFileIndex.empty()) {
+    Pool.async([&]() {
+      if (!IndexWriter(OutFileIndex, All)) Failed = true;
+    });
+  }
+  Pool.wait();
+  if (Failed) {
+    return 1;
+  }
+  // the units files last, see isUnitsFileCurrent
+  for (auto &K : Kept) {
+    Pool.async([&]() {
+      if (!UnitsWriter(K.first, K.second)) Failed = true;
+    });
+  }
+  Pool.wait();
+  if (Failed) {
+    return 1;
+  }
+
+  for (auto &T : Taken) {
+    sys::fs::remove(T);
+  }
+  for (auto &S : Spills) {
+    sys::fs::remove(S);
+  }
+
+  outs() << "Merged " << Shards.size() + Databases.size()
+         << " shards and databases, "
+         << SharedTables.size() << " shared tables, "
+         << Taken.size() << " journals, " << Spills.size()
+         << " spill files\n";
+  return 0;
+}
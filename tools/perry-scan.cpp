@@ -0,0 +1,194 @@
+#include "PerryClangPlugin.h"
+
+#include "clang/Frontend/FrontendActions.h"
+#include "clang/Tooling/CommonOptionsParser.h"
+#include "clang/Tooling/Tooling.h"
+
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <atomic>
+
+using namespace clang;
+using namespace clang::tooling;
+using namespace llvm;
+
+static cl::OptionCategory PerryScanCategory("perry-scan options");
+
+static cl::opt<std::string>
+OutFileSuccRet("out-file-succ-ret", cl::Required,
+               cl::desc("Output success return file"),
+               cl::cat(PerryScanCategory));
+
+static cl::opt<std::string>
+OutFileApi("out-file-api", cl::Required, cl::desc("Output API file"),
+           cl::cat(PerryScanCategory));
+
+static cl::opt<std::string>
+OutFileLoops("out-file-loops", cl::Required, cl::desc("Output loops file"),
+             cl::cat(PerryScanCategory));
+
+static cl::opt<std::string>
+OutFileStructNames("out-file-periph-struct", cl::Required,
+                   cl::desc("Output peripheral struct name file"),
+                   cl::cat(PerryScanCategory));
+
+static cl::opt<std::string>
+OutFileIndex("out-file-index", cl::init(""),
+             cl::desc("Also write the binary index read by PerryIndexReader"),
+             cl::cat(PerryScanCategory));
+
+static cl::opt<std::string>
+HeaderCacheDir("header-cache-dir", cl::init(""),
+               cl::desc("Directory to keep summaries of headers in"),
+               cl::cat(PerryScanCategory));
+
+static cl::opt<bool>
+ScopeSkipSystem("scope-skip-system",
+                cl::desc("Skip decls in system headers"),
+                cl::cat(PerryScanCategory));
+
+static cl::list<std::string>
+ScopeAllow("scope-allow", cl::ZeroOrMore,
+           cl::desc("Only analyze decls in files under this path"),
+           cl::cat(PerryScanCategory));
+
+static cl::list<std::string>
+ScopeDeny("scope-deny", cl::ZeroOrMore,
+          cl::desc("Never analyze decls in files under this path"),
+          cl::cat(PerryScanCategory));
+
+static cl::opt<bool>
+AllowErrors("allow-errors",
+            cl::desc("Write the records of the translation units that were "
+                     "parsed even if others failed"),
+            cl::cat(PerryScanCategory));
+
+static cl::opt<unsigned>
+Jobs("j", cl::init(0),
+     cl::desc("Number of threads, default to the number of cores"),
+     cl::cat(PerryScanCategory));
+
+// Runs the analysis of the plugin, handing the results to Opts.Sink
+class PerryScanAction : public ASTFrontendAction {
+public:
+  PerryScanAction(const PerryOutputOptions &Opts) : Opts(Opts) {}
+
+  std::unique_ptr<ASTConsumer>
+  CreateASTConsumer(CompilerInstance &CI, StringRef InFile) override {
+    auto ret = std::make_unique<PerryASTConsumer>(CI.getASTContext(), CI, Opts);
+    CI.getPreprocessor().addPPCallbacks(
+      std::make_unique<PerryPeriphStructDefProcessor>(ret->getResults(),
+                                                      ret->getTimers()));
+    return ret;
+  }
+
+private:
+  const PerryOutputOptions &Opts;
+};
+
+class PerryScanActionFactory : public FrontendActionFactory {
+public:
+  PerryScanActionFactory(const PerryOutputOptions &Opts) : Opts(Opts) {}
+
+  std::unique_ptr<FrontendAction> create() override {
+    return std::make_unique<PerryScanAction>(Opts);
+  }
+
+private:
+  const PerryOutputOptions &Opts;
+};
+
+int main(int argc, const char *argv[]) {
+  auto ExpectedParser = CommonOptionsParser::create(
+    argc, argv, PerryScanCategory, cl::ZeroOrMore,
+    "Run the Perry analysis over a compilation database\n");
+  if (!ExpectedParser) {
+    errs() << toString(ExpectedParser.takeError());
+    return 1;
+  }
+  CommonOptionsParser &OptionsParser = ExpectedParser.get();
+  auto &Compilations = OptionsParser.getCompilations();
+  // scan the whole database unless told otherwise
+  std::vector<std::string> Sources = OptionsParser.getSourcePathList();
+  if (Sources.empty()) {
+    Sources = Compilations.getAllFiles();
+  }
+
+  // every worker takes the next TU once it is done with the previous one, so
+  // a few expensive TUs do not hold up the others. Records are merged into
+  // the results of the worker, no file is touched until the end
+  ThreadPool Pool(hardware_concurrency(Jobs));
+  unsigned NumWorkers = std::max(1u, Pool.getThreadCount());
+  std::vector<PerryResults> Partial(NumWorkers);
+  std::atomic<size_t> Next(0);
+  std::atomic<unsigned> NumFailed(0);
+  for (unsigned w = 0; w < NumWorkers; ++w) {
+    Pool.async([&, w]() {
+      PerryOutputOptions Opts;
+      Opts.HeaderCacheDir = HeaderCacheDir;
+      Opts.ScopeSkipSystem = ScopeSkipSystem;
+      Opts.ScopeAllow = ScopeAllow;
+      Opts.ScopeDeny = ScopeDeny;
+      canonicalizeScopePaths(Opts);
+      Opts.Sink = [&Partial, w](const PerryResults &R) {
+        Partial[w].merge(R);
+      };
+      PerryScanActionFactory Factory(Opts);
+      for (size_t i = Next++; i < Sources.size(); i = Next++) {
+        // ClangTool runs -fsyntax-only, nothing is generated. It changes to
+        // the directory of the compile command, which must only affect the
+        // file system of this tool, not the process the workers share
+        ClangTool Tool(Compilations, {Sources[i]},
+                       std::make_shared<PCHContainerOperations>(),
+                       vfs::createPhysicalFileSystem());
+        if (Tool.run(&Factory)) {
+          ++NumFailed;
+        }
+      }
+    });
+  }
+  Pool.wait();
+
+  // the records of a TU that failed are missing, so the outputs would be
+  // incomplete
+  if (NumFailed && !AllowErrors) {
+    errs() << NumFailed << " of " << Sources.size()
+           << " translation units failed, no output written\n";
+    return 1;
+  }
+
+  PerryResults All;
+  for (auto &P : Partial) {
+    All.merge(P);
+  }
+  Partial.clear();
+
+  std::atomic<bool> Failed(false);
+  Pool.async([&]() {
+    if (!SuccRetCacheWriter(OutFileSuccRet, All)) Failed = true;
+  });
+  Pool.async([&]() {
+    if (!ApiCacheWriter(OutFileApi, All)) Failed = true;
+  });
+  Pool.async([&]() {
+    if (!LoopCacheWriter(OutFileLoops, All)) Failed = true;
+  });
+  Pool.async([&]() {
+    if (!StructCacheWriter(OutFileStructNames, All)) Failed = true;
+  });
+  if (!OutFileIndex.empty()) {
+    Pool.async([&]() {
+      if (!IndexWriter(OutFileIndex, All)) Failed = true;
+    });
+  }
+  Pool.wait();
+  if (Failed) {
+    return 1;
+  }
+
+  outs() << "Scanned " << Sources.size() << " translation units, "
+         << NumFailed << " with errors\n";
+  return 0;
+}
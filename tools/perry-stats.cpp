@@ -0,0 +1,136 @@
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <cmath>
+#include <map>
+
+using namespace llvm;
+
+static cl::list<std::string>
+StatsFiles(cl::Positional, cl::OneOrMore,
+           cl::desc("<statistics written with -stats-file>"));
+
+struct CacheTotals {
+  uint64_t Updates = 0;
+  double LockWaitMs = 0;
+  uint64_t Retries = 0;
+  uint64_t Timeouts = 0;
+  uint64_t Spilled = 0;
+  uint64_t BytesRead = 0;
+  uint64_t BytesWritten = 0;
+  uint64_t RecordsAdded = 0;
+  uint64_t RecordsRetracted = 0;
+};
+
+// nearest-rank percentile of sorted values
+static double percentile(const std::vector<double> &Sorted, double P) {
+  if (Sorted.empty()) {
+    return 0;
+  }
+  size_t Rank = (size_t)std::ceil(P / 100 * Sorted.size());
+  return Sorted[std::max<size_t>(Rank, 1) - 1];
+}
+
+static bool read_stats(const std::string &Path, std::vector<double> &TUWaits,
+                       std::map<std::string, CacheTotals> &Caches) {
+  auto Result = MemoryBuffer::getFile(Path);
+  if (!bool(Result)) {
+    errs() << "Failed to open " << Path << " for read: "
+           << Result.getError().message() << "\n";
+    return false;
+  }
+  SmallVector<StringRef, 0> Lines;
+  Result->get()->getBuffer().split(Lines, '\n', -1, false);
+  for (auto Line : Lines) {
+    auto Parsed = json::parse(Line);
+    if (!Parsed) {
+      // a TU killed in the middle of its write, skip it
+      consumeError(Parsed.takeError());
+      continue;
+    }
+    auto *TU = Parsed->getAsObject();
+    if (!TU) {
+      continue;
+    }
+    TUWaits.push_back(TU->getNumber("lock_wait_ms").getValueOr(0));
+    auto *Updates = TU->getArray("caches");
+    if (!Updates) {
+      continue;
+    }
+    for (auto &U : *Updates) {
+      auto *Update = U.getAsObject();
+      if (!Update) {
+        continue;
+      }
+      auto &T = Caches[Update->getString("cache").getValueOr("?").str()];
+      ++T.Updates;
+      T.LockWaitMs += Update->getNumber("lock_wait_ms").getValueOr(0);
+      T.Retries += Update->getInteger("retries").getValueOr(0);
+      T.Timeouts += Update->getInteger("timeouts").getValueOr(0);
+      T.Spilled += Update->getBoolean("spilled").getValueOr(false);
+      T.BytesRead += Update->getInteger("bytes_read").getValueOr(0);
+      T.BytesWritten += Update->getInteger("bytes_written").getValueOr(0);
+      T.RecordsAdded += Update->getInteger("records_added").getValueOr(0);
+      T.RecordsRetracted +=
+        Update->getInteger("records_retracted").getValueOr(0);
+    }
+  }
+  return true;
+}
+
+int main(int argc, char *argv[]) {
+  cl::ParseCommandLineOptions(argc, argv,
+                              "Summarize Perry lock and I/O statistics\n");
+  std::vector<double> TUWaits;
+  std::map<std::string, CacheTotals> Caches;
+  for (auto &Path : StatsFiles) {
+    if (!read_stats(Path, TUWaits, Caches)) {
+      return 1;
+    }
+  }
+  std::sort(TUWaits.begin(), TUWaits.end());
+
+  CacheTotals All;
+  for (auto &C : Caches) {
+    All.Updates += C.second.Updates;
+    All.LockWaitMs += C.second.LockWaitMs;
+    All.Retries += C.second.Retries;
+    All.Timeouts += C.second.Timeouts;
+    All.Spilled += C.second.Spilled;
+    All.BytesRead += C.second.BytesRead;
+    All.BytesWritten += C.second.BytesWritten;
+    All.RecordsAdded += C.second.RecordsAdded;
+    All.RecordsRetracted += C.second.RecordsRetracted;
+  }
+
+  outs() << "Translation units:   " << TUWaits.size() << "\n"
+         << "Lock wait per TU:    "
+         << format("p50 %.1f ms, p99 %.1f ms, max %.1f ms, total %.1f ms\n",
+                   percentile(TUWaits, 50), percentile(TUWaits, 99),
+                   TUWaits.empty() ? 0.0 : TUWaits.back(), All.LockWaitMs)
+         << "Lock retries:        " << All.Retries << ", "
+         << All.Timeouts << " timeouts, " << All.Spilled << " spilled\n"
+         << "Plugin I/O:          " << All.BytesRead << " bytes read, "
+         << All.BytesWritten << " bytes written\n"
+         << "Records added:       " << All.RecordsAdded << ", "
+         << All.RecordsRetracted << " retracted\n\n";
+
+  outs() << "output            updates   lock wait ms  retries"
+            "     bytes read  bytes written      added  retracted\n";
+  for (auto &C : Caches) {
+    outs() << format("%-16s %8llu %14.1f %8llu %14llu %14llu %10llu %10llu\n",
+                     C.first.c_str(),
+                     (unsigned long long)C.second.Updates,
+                     C.second.LockWaitMs,
+                     (unsigned long long)C.second.Retries,
+                     (unsigned long long)C.second.BytesRead,
+                     (unsigned long long)C.second.BytesWritten,
+                     (unsigned long long)C.second.RecordsAdded,
+                     (unsigned long long)C.second.RecordsRetracted);
+  }
+  return 0;
+}